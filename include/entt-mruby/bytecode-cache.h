@@ -0,0 +1,295 @@
+#pragma once
+
+#include <mruby.h>
+#include <mruby/compile.h>
+#include <mruby/dump.h>
+#include <mruby/proc.h>
+#include <mruby/array.h>
+#include <mruby/irep.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace MRuby
+{
+
+// 64-bit FNV-1a over a script's source text
+inline std::uint64_t hash_script(const char* data, std::size_t size)
+{
+  std::uint64_t hash = 14695981039346656037ull;
+  for(std::size_t i = 0; i < size; ++i)
+  {
+    hash ^= static_cast< unsigned char >(data[i]);
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+// A second, unrelated 64-bit hash stored with cached files, so a file
+// whose name matches by chance is not run
+inline std::uint64_t check_script(const char* data, std::size_t size)
+{
+  std::uint64_t hash = size * 0x9e3779b97f4a7c15ull;
+  for(std::size_t i = 0; i < size; ++i)
+    hash = (hash ^ static_cast< unsigned char >(data[i])) * 0xff51afd7ed558ccdull + 0x2545f4914f6cdd1dull;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ull;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+struct BytecodeCacheStats
+{
+  std::size_t hits = 0, misses = 0;
+  std::size_t disk_hits = 0, disk_writes = 0;
+};
+
+// Compiled-irep cache keyed by a hash of the script text. Procs are kept
+// alive through a single rooted array. When a directory is given, compiled
+// scripts are also stored there as <hash>.mrb and memory-mapped on load.
+// Hits are verified, against the source itself in memory and against its
+// length and a second hash on disk.
+struct BytecodeCache
+{
+#ifdef MRB_DUMP_DEBUG_INFO
+  static constexpr std::uint8_t dump_flags = MRB_DUMP_DEBUG_INFO;
+#else
+  static constexpr std::uint8_t dump_flags = DUMP_DEBUG_INFO;
+#endif
+
+  struct Mapping
+  {
+    void* data;
+    std::size_t size;
+  };
+
+  struct Entry
+  {
+    mrb_int slot;
+    std::string source;
+  };
+
+  // Written before the RITE binary of a cached file. 24 bytes, the
+  // bytecode after it stays aligned.
+  struct FileHeader
+  {
+    char magic[8];
+    std::uint64_t length;
+    std::uint64_t check;
+  };
+  static constexpr char file_magic[8] = { 'E', 'M', 'R', 'B', 'C', '0', '0', '1' };
+
+  mrb_state* state = nullptr;
+  mrb_value procs = mrb_nil_value();
+  std::unordered_map< std::uint64_t, Entry > slots;
+  std::string directory;
+  BytecodeCacheStats stats;
+
+  // ireps read from a .mrb file reference the mapping directly, so mappings
+  // live as long as the cache does
+  std::vector< Mapping > mappings;
+
+  BytecodeCache() = default;
+  BytecodeCache(const BytecodeCache&) = delete;
+  BytecodeCache& operator= (const BytecodeCache&) = delete;
+
+  ~BytecodeCache()
+  {
+    for(auto& mapping : mappings)
+      munmap(mapping.data, mapping.size);
+  }
+
+  bool enabled(mrb_state* state) const
+  {
+    return this->state && this->state == state;
+  }
+
+  void enable(mrb_state* state, const std::string& directory = std::string())
+  {
+    disable();
+    this->state = state;
+    this->directory = directory;
+    procs = mrb_ary_new(state);
+    mrb_gc_register(state, procs);
+  }
+
+  void disable()
+  {
+    if(!state)
+      return;
+    mrb_gc_unregister(state, procs);
+    procs = mrb_nil_value();
+    slots.clear();
+    state = nullptr;
+  }
+
+  std::string path_for(std::uint64_t key) const
+  {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.mrb", (unsigned long long)key);
+    return directory + "/" + name;
+  }
+
+  // Returns the compiled proc for code, or nullptr with state->exc set
+  RProc* compile(const char* code, std::size_t size, const char* filename = nullptr)
+  {
+    const auto key = hash_script(code, size);
+    const auto iter = slots.find(key);
+    if(iter != slots.cend() && iter->second.source.compare(0, std::string::npos, code, size) == 0)
+    {
+      ++stats.hits;
+      return mrb_proc_ptr(mrb_ary_entry(procs, iter->second.slot));
+    }
+    ++stats.misses;
+
+    // Another script with the same hash, compiled without being cached
+    if(iter != slots.cend())
+    {
+      RProc* proc = parse(code, size, filename);
+      if(proc)
+        MRB_PROC_SET_TARGET_CLASS(proc, state->object_class);
+      return proc;
+    }
+
+    RProc* proc = nullptr;
+    if(! directory.empty())
+      proc = read_file(key, code, size);
+
+    if(proc)
+      ++stats.disk_hits;
+    else
+    {
+      proc = parse(code, size, filename);
+      if(!proc)
+        return nullptr;
+      if(! directory.empty())
+        write_file(key, code, size, proc);
+    }
+
+    MRB_PROC_SET_TARGET_CLASS(proc, state->object_class);
+    slots[ key ] = { RARRAY_LEN(procs), std::string(code, size) };
+    mrb_ary_push(state, procs, mrb_obj_value(proc));
+    return proc;
+  }
+
+  mrb_value eval(const char* code, std::size_t size, const char* filename = nullptr)
+  {
+    RProc* proc = compile(code, size, filename);
+    if(!proc)
+      return mrb_nil_value();
+    return mrb_top_run(state, proc, mrb_top_self(state), 0);
+  }
+
+  mrb_value load_file(const std::string& path)
+  {
+    std::string code;
+    if(! read_source(path, code))
+    {
+      std::cout << "BytecodeCache: unable to read " << path << std::endl;
+      return mrb_nil_value();
+    }
+    return eval(code.data(), code.size(), path.c_str());
+  }
+
+  static bool read_source(const std::string& path, std::string& output)
+  {
+    FILE* fp = fopen(path.c_str(), "rb");
+    if(!fp)
+      return false;
+    output.clear();
+    char buffer[4096];
+    std::size_t count;
+    while((count = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+      output.append(buffer, count);
+    fclose(fp);
+    return true;
+  }
+
+private:
+  RProc* parse(const char* code, std::size_t size, const char* filename)
+  {
+    mrbc_context* context = mrbc_context_new(state);
+    context->no_exec = TRUE;
+    if(filename)
+      mrbc_filename(state, context, filename);
+    mrb_value value = mrb_load_nstring_cxt(state, code, size, context);
+    mrbc_context_free(state, context);
+
+    if(state->exc || mrb_type(value) != MRB_TT_PROC)
+      return nullptr;
+    return mrb_proc_ptr(value);
+  }
+
+  // The file must be of this very source, and hold one whole RITE binary
+  RProc* read_file(std::uint64_t key, const char* code, std::size_t size)
+  {
+    const auto path = path_for(key);
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+      return nullptr;
+
+    struct stat info;
+    void* data = MAP_FAILED;
+    if(fstat(fd, &info) == 0 && info.st_size > 0)
+      data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+      return nullptr;
+
+    mrb_irep* irep = nullptr;
+    const std::size_t length = info.st_size;
+    const auto header = (const FileHeader*)data;
+    const auto rite = (const std::uint8_t*)data + sizeof(FileHeader);
+    const std::size_t rite_size = length > sizeof(FileHeader) ? length - sizeof(FileHeader) : 0;
+    if(rite_size >= sizeof(rite_binary_header)
+      && std::memcmp(header->magic, file_magic, sizeof(file_magic)) == 0
+      && header->length == size
+      && header->check == check_script(code, size)
+      && bin_to_uint32(((const rite_binary_header*)rite)->binary_size) == rite_size)
+      irep = mrb_read_irep_buf(state, rite, rite_size);
+    if(!irep)
+    {
+      // Stale or foreign bytecode, recompile and overwrite it
+      munmap(data, info.st_size);
+      return nullptr;
+    }
+    mappings.push_back({ data, static_cast< std::size_t >(info.st_size) });
+
+    RProc* proc = mrb_proc_new(state, irep);
+    mrb_irep_decref(state, irep);
+    return proc;
+  }
+
+  void write_file(std::uint64_t key, const char* code, std::size_t size, RProc* proc)
+  {
+    const auto path = path_for(key);
+    const auto temp = path + ".tmp";
+    FILE* fp = fopen(temp.c_str(), "wb");
+    if(!fp)
+      return;
+    FileHeader header;
+    std::memcpy(header.magic, file_magic, sizeof(file_magic));
+    header.length = size;
+    header.check = check_script(code, size);
+    int result = fwrite(&header, sizeof(header), 1, fp) == 1 ? MRB_DUMP_OK : MRB_DUMP_WRITE_FAULT;
+    if(result == MRB_DUMP_OK)
+      result = mrb_dump_irep_binary(state, proc->body.irep, dump_flags, fp);
+    fclose(fp);
+    if(result == MRB_DUMP_OK && rename(temp.c_str(), path.c_str()) == 0)
+      ++stats.disk_writes;
+    else
+      unlink(temp.c_str());
+  }
+};
+
+} // ::MRuby
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <mruby.h>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+namespace MRuby
+{
+
+// Write history of one component, an append-only log of (tick, entity)
+// plus the latest write of each entity number. An entry is live while it
+// matches the latest write, version included so a recycled number is a new
+// entity. Older entries are superseded and compacted away once they make
+// up half the log.
+struct ChangeLog
+{
+  struct Latest
+  {
+    std::uint64_t tick = 0;
+    entt::entity entity{};
+  };
+
+  std::vector< std::uint64_t > ticks;
+  std::vector< entt::entity > entities;
+  std::vector< Latest > latest;
+  std::size_t superseded = 0;
+
+  static std::size_t number(entt::entity entity)
+  {
+    using traits = entt::entt_traits< std::underlying_type_t< entt::entity > >;
+    return std::underlying_type_t< entt::entity >(entity) & traits::entity_mask;
+  }
+
+  void mark(std::uint64_t tick, entt::entity entity)
+  {
+    const auto slot = number(entity);
+    if(slot >= latest.size())
+      latest.resize(slot + 1);
+    auto& last = latest[ slot ];
+    if(last.tick == tick && last.entity == entity)
+      return;
+    if(last.tick)
+      ++superseded;
+    last = { tick, entity };
+    ticks.push_back(tick);
+    entities.push_back(entity);
+  }
+
+  bool live(std::size_t i) const
+  {
+    const auto& last = latest[ number(entities[i]) ];
+    return last.tick == ticks[i] && last.entity == entities[i];
+  }
+
+  void compact()
+  {
+    if(ticks.size() < 1024 || superseded * 2 < ticks.size())
+      return;
+    std::size_t out = 0;
+    for(std::size_t i = 0; i < ticks.size(); ++i)
+      if(live(i))
+      {
+        ticks[ out ] = ticks[i];
+        entities[ out ] = entities[i];
+        ++out;
+      }
+    ticks.resize(out);
+    entities.resize(out);
+    superseded = 0;
+  }
+
+  // Calls fn(entity) once for each entity written after since
+  template< typename Fn >
+  void each_since(std::uint64_t since, Fn&& fn) const
+  {
+    auto pos = std::upper_bound(ticks.cbegin(), ticks.cend(), since) - ticks.cbegin();
+    for(; pos < static_cast< std::ptrdiff_t >(ticks.size()); ++pos)
+      if(live(pos))
+        fn(entities[ pos ]);
+  }
+};
+
+// Change tracking for the components it has been enabled for, indexed by
+// component id. Static components are fed by entt's construct, update and
+// destroy signals, dynamic components by DynamicComponents and columns by
+// their own writes. Lives in the registry context.
+struct ChangeTracker
+{
+  std::uint64_t tick = 1;
+  std::vector< std::unique_ptr< ChangeLog > > logs;
+  // Worker VMs replace components from several threads
+  std::mutex mutex;
+
+  ChangeLog* log(mrb_int type)
+  {
+    if(type < 0 || static_cast< std::size_t >(type) >= logs.size())
+      return nullptr;
+    return logs[ type ].get();
+  }
+
+  bool tracked(mrb_int type) const
+  {
+    return type >= 0 && static_cast< std::size_t >(type) < logs.size() && logs[ type ];
+  }
+
+  // Returns false if type was already tracked
+  bool track(mrb_int type)
+  {
+    std::lock_guard< std::mutex > lock(mutex);
+    if(static_cast< std::size_t >(type) >= logs.size())
+      logs.resize(type + 1);
+    if(logs[ type ])
+      return false;
+    logs[ type ] = std::make_unique< ChangeLog >();
+    return true;
+  }
+
+  void mark(mrb_int type, entt::entity entity)
+  {
+    std::lock_guard< std::mutex > lock(mutex);
+    if(auto log = this->log(type))
+      log->mark(tick, entity);
+  }
+
+  void mark(mrb_int type, const entt::entity* entities, std::size_t count)
+  {
+    std::lock_guard< std::mutex > lock(mutex);
+    if(auto log = this->log(type))
+      for(std::size_t i = 0; i < count; ++i)
+        log->mark(tick, entities[i]);
+  }
+
+  template< typename Component >
+  static void record(ChangeTracker& tracker, entt::registry&, entt::entity entity)
+  {
+    tracker.mark(entt::type_seq< Component >::value(), entity);
+  }
+
+  template< typename Component >
+  static void connect(entt::registry& registry, ChangeTracker& tracker)
+  {
+    registry.on_construct< Component >().template connect< &record< Component > >(tracker);
+    registry.on_update< Component >().template connect< &record< Component > >(tracker);
+    registry.on_destroy< Component >().template connect< &record< Component > >(tracker);
+  }
+
+  // Ends the current tick, changes from here on get the next one
+  std::uint64_t advance()
+  {
+    std::lock_guard< std::mutex > lock(mutex);
+    for(auto& log : logs)
+      if(log)
+        log->compact();
+    return ++tick;
+  }
+};
+
+} // ::MRuby
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <mruby.h>
+#include <mruby/array.h>
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+namespace MRuby
+{
+
+struct Command
+{
+  enum Kind : std::uint8_t
+  {
+    set,
+    set_many,
+    remove,
+    destroy
+  };
+
+  Kind kind;
+  mrb_int type;
+  entt::entity entity;
+  // Slice of CommandBuffer::args
+  mrb_int args, argc;
+};
+
+// Structural changes made by scripts while the registry is being iterated.
+// They're recorded here and applied by RegistryMixin::mrb_flush once the
+// outermost iteration ends, grouped by component so each pool is edited
+// in one pass.
+struct CommandBuffer
+{
+  mrb_state* state = nullptr;
+  // Arguments of recorded commands, rooted
+  mrb_value args = mrb_nil_value();
+  std::vector< Command > commands;
+  int depth = 0;
+
+  void init(mrb_state* state)
+  {
+    this->state = state;
+    args = mrb_ary_new(state);
+    mrb_gc_register(state, args);
+    commands.clear();
+    depth = 0;
+  }
+
+  bool deferring() const
+  {
+    return depth > 0;
+  }
+
+  bool empty() const
+  {
+    return commands.empty();
+  }
+
+  void record(Command::Kind kind, mrb_int type, entt::entity entity, mrb_int argc = 0, const mrb_value* argv = nullptr)
+  {
+    commands.push_back({ kind, type, entity, RARRAY_LEN(args), argc });
+    for(mrb_int i = 0; i < argc; ++i)
+      mrb_ary_push(state, args, argv[i]);
+  }
+
+  const mrb_value* argv(const Command& command) const
+  {
+    return RARRAY_PTR(args) + command.args;
+  }
+
+  // Group commands by component, keeping their recorded order within a
+  // component. Destroys go last so they see every other change first.
+  void sort()
+  {
+    std::stable_sort(commands.begin(), commands.end(), [](const Command& lhs, const Command& rhs)
+    {
+      const bool lhs_destroy = lhs.kind == Command::destroy;
+      const bool rhs_destroy = rhs.kind == Command::destroy;
+      if(lhs_destroy != rhs_destroy)
+        return rhs_destroy;
+      return lhs.type < rhs.type;
+    });
+  }
+
+  void clear()
+  {
+    commands.clear();
+    mrb_ary_clear(state, args);
+  }
+};
+
+} // ::MRuby
@@ -0,0 +1,393 @@
+#pragma once
+
+#include "mruby-bindings.h"
+#include "change-tracker.h"
+#include "write-mask.h"
+
+#include <mruby/data.h>
+#include <mruby/array.h>
+
+#include <cmath>
+#include <string>
+#include <algorithm>
+
+namespace MRuby
+{
+
+// One field of every component in a storage, in storage order. entt keeps
+// whole components packed together, so consecutive values are stride bytes
+// apart.
+struct ColumnSpan
+{
+  const entt::entity* entities;
+  char* base;
+  std::size_t size, stride;
+};
+
+// How a column reaches its storage. The span is fetched again before every
+// operation since the storage may have grown or been sorted meanwhile.
+struct ColumnSource
+{
+  ColumnSpan(*span)(entt::registry&);
+  char*(*find)(entt::registry&, entt::entity);
+  // Columns of the same storage share an order and zip by index
+  entt::id_type pool;
+};
+
+template< typename Component, auto Member >
+struct ColumnAccess
+{
+  static ColumnSpan span(entt::registry& registry)
+  {
+    auto view = registry.view< Component >();
+    Component* raw = view.raw();
+    if(! view.size())
+      return { view.data(), nullptr, 0, sizeof(Component) };
+    return { view.data(), (char*)&(raw->*Member), view.size(), sizeof(Component) };
+  }
+
+  static char* find(entt::registry& registry, entt::entity entity)
+  {
+    if(! registry.valid(entity))
+      return nullptr;
+    if(auto component = registry.try_get< Component >(entity))
+      return (char*)&(component->*Member);
+    return nullptr;
+  }
+
+  static ColumnSource source()
+  {
+    return { span, find, entt::type_seq< Component >::value() };
+  }
+};
+
+struct ColumnData
+{
+  entt::registry* registry;
+  ColumnSource source;
+  const WriteMask* writes;
+
+  ColumnSpan span() const
+  {
+    return source.span(*registry);
+  }
+};
+
+template< typename T >
+T& column_at(const ColumnSpan& span, std::size_t index)
+{
+  return *(T*)(span.base + index * span.stride);
+}
+
+// Applies op(self_value, other_value) to every entity present in both
+// columns. Columns over the same storage of the same registry line up
+// index for index, others are joined through the other column's storage.
+template< typename T, typename U, typename Op >
+void column_zip(const ColumnData& self, const ColumnData& other, Op&& op)
+{
+  const auto lhs = self.span();
+  if(self.registry == other.registry && self.source.pool == other.source.pool)
+  {
+    const auto rhs = other.span();
+    for(std::size_t i = 0; i < lhs.size; ++i)
+      op(column_at< T >(lhs, i), column_at< U >(rhs, i));
+    return;
+  }
+
+  for(std::size_t i = 0; i < lhs.size; ++i)
+    if(auto value = other.source.find(*other.registry, lhs.entities[i]))
+      op(column_at< T >(lhs, i), *(U*)value);
+}
+
+template< typename T >
+struct ColumnBinder
+{
+  static void free(mrb_state* state, void* ptr)
+  {
+    if(ptr)
+      mrb_free(state, ptr);
+  }
+
+  static std::string type_name;
+  static mrb_data_type mrb_type;
+
+  static mrb_value init(mrb_state* state, mrb_value self)
+  {
+    mrb_raise(state, mrb_exc_get(state, "TypeError"), "columns are created by Registry#column");
+    return self;
+  }
+};
+template< typename T >
+std::string ColumnBinder< T >::type_name =
+  std::is_same_v< T, float > ? "FloatColumn" : "DoubleColumn";
+template< typename T >
+mrb_data_type ColumnBinder< T >::mrb_type{
+  ColumnBinder< T >::type_name.c_str(), ColumnBinder< T >::free
+};
+
+// FloatColumn and DoubleColumn, a view over a float or double field. The
+// arithmetic runs as plain loops over the storage and writes bypass
+// on_update listeners, though they are recorded by the ChangeTracker.
+template< typename T >
+struct Column
+{
+  using Binder = ColumnBinder< T >;
+
+  static void define(mrb_state* state)
+  {
+    MRuby::Class::bind< T, ColumnBinder >(state, Binder::type_name.c_str(), state->object_class)
+      .define_method("size", size, MRB_ARGS_NONE())
+      .define_method("[]", index_get, MRB_ARGS_REQ(1))
+      .define_method("[]=", index_set, MRB_ARGS_REQ(2))
+      .define_method("to_a", to_a, MRB_ARGS_NONE())
+      .define_method("entities", entities, MRB_ARGS_NONE())
+      .define_method("add", add, MRB_ARGS_REQ(1))
+      .define_method("scale", scale, MRB_ARGS_REQ(1))
+      .define_method("axpy", axpy, MRB_ARGS_REQ(2))
+      .define_method("clamp", clamp, MRB_ARGS_REQ(2))
+      .define_method("min", min, MRB_ARGS_NONE())
+      .define_method("max", max, MRB_ARGS_NONE())
+      .define_method("sum", sum, MRB_ARGS_NONE())
+      .define_method("dot", dot, MRB_ARGS_REQ(1))
+    ;
+  }
+
+  static mrb_value wrap(mrb_state* state, entt::registry& registry, const ColumnSource& source)
+  {
+    RClass* klass = mrb_class_get(state, Binder::type_name.c_str());
+    RData* object = Data_Wrap_Struct(state, klass, &Binder::mrb_type, nullptr);
+    auto data = (ColumnData*)mrb_malloc(state, sizeof(ColumnData));
+    data->registry = &registry;
+    data->source = source;
+    data->writes = write_mask(state);
+    object->data = data;
+    return mrb_obj_value(object);
+  }
+
+  static ColumnData& data(mrb_state* state, mrb_value self)
+  {
+    return *DATA_GET_PTR(state, self, &Binder::mrb_type, ColumnData);
+  }
+
+  // The column of self about to be written, see WriteMask
+  static ColumnData& written(mrb_state* state, mrb_value self)
+  {
+    auto& column = data(state, self);
+    check_write(state, column.writes, column.source.pool);
+    return column;
+  }
+
+  static T scalar(mrb_state* state, mrb_value value)
+  {
+    double output;
+    if(! from_mrb(state, value, output))
+      mrb_raise(state, mrb_exc_get(state, "TypeError"), "expected a Numeric");
+    return static_cast< T >(output);
+  }
+
+  // Calls fn.template operator()< U >(other) with the other column's type
+  template< typename Fn >
+  static void with_column(mrb_state* state, mrb_value value, Fn&& fn)
+  {
+    if(mrb_type(value) == MRB_TT_DATA && DATA_TYPE(value) == &ColumnBinder< float >::mrb_type)
+      fn.template operator()< float >(Column< float >::data(state, value));
+    else if(mrb_type(value) == MRB_TT_DATA && DATA_TYPE(value) == &ColumnBinder< double >::mrb_type)
+      fn.template operator()< double >(Column< double >::data(state, value));
+    else
+      mrb_raise(state, mrb_exc_get(state, "TypeError"), "expected a FloatColumn or DoubleColumn");
+  }
+
+  // Record a write to every value, or to one
+  static void touched(const ColumnData& column, const ColumnSpan& span)
+  {
+    auto tracker = column.registry->try_ctx< ChangeTracker >();
+    if(tracker && tracker->tracked(column.source.pool))
+      tracker->mark(column.source.pool, span.entities, span.size);
+  }
+
+  static void touched(const ColumnData& column, entt::entity entity)
+  {
+    auto tracker = column.registry->try_ctx< ChangeTracker >();
+    if(tracker && tracker->tracked(column.source.pool))
+      tracker->mark(column.source.pool, entity);
+  }
+
+  static std::size_t checked_index(mrb_state* state, const ColumnSpan& span, mrb_int index)
+  {
+    if(index < 0)
+      index += span.size;
+    if(index < 0 || static_cast< std::size_t >(index) >= span.size)
+      mrb_raise(state, mrb_exc_get(state, "IndexError"), "column index out of range");
+    return index;
+  }
+
+  static mrb_value size(mrb_state* state, mrb_value self)
+  {
+    return mrb_fixnum_value(data(state, self).span().size);
+  }
+
+  static mrb_value index_get(mrb_state* state, mrb_value self)
+  {
+    mrb_int index;
+    mrb_get_args(state, "i", &index);
+    const auto span = data(state, self).span();
+    return mrb_float_value(state, column_at< T >(span, checked_index(state, span, index)));
+  }
+
+  static mrb_value index_set(mrb_state* state, mrb_value self)
+  {
+    mrb_int index;
+    mrb_value value;
+    mrb_get_args(state, "io", &index, &value);
+    auto& column = written(state, self);
+    const auto span = column.span();
+    const auto slot = checked_index(state, span, index);
+    column_at< T >(span, slot) = scalar(state, value);
+    touched(column, span.entities[ slot ]);
+    return value;
+  }
+
+  static mrb_value to_a(mrb_state* state, mrb_value self)
+  {
+    const auto span = data(state, self).span();
+    mrb_value array = mrb_ary_new_capa(state, span.size);
+    const int arena = mrb_gc_arena_save(state);
+    for(std::size_t i = 0; i < span.size; ++i)
+    {
+      mrb_ary_push(state, array, mrb_float_value(state, column_at< T >(span, i)));
+      mrb_gc_arena_restore(state, arena);
+    }
+    return array;
+  }
+
+  static mrb_value entities(mrb_state* state, mrb_value self)
+  {
+    const auto span = data(state, self).span();
+    mrb_value array = mrb_ary_new_capa(state, span.size);
+    for(std::size_t i = 0; i < span.size; ++i)
+      mrb_ary_push(state, array, mrb_fixnum_value(std::underlying_type_t< entt::entity >(span.entities[i])));
+    return array;
+  }
+
+  // column.add(2.0) or column.add(other_column)
+  static mrb_value add(mrb_state* state, mrb_value self)
+  {
+    mrb_value value;
+    mrb_get_args(state, "o", &value);
+    auto& column = written(state, self);
+
+    if(mrb_float_p(value) || mrb_fixnum_p(value))
+    {
+      const T x = scalar(state, value);
+      const auto span = column.span();
+      for(std::size_t i = 0; i < span.size; ++i)
+        column_at< T >(span, i) += x;
+    }
+    else
+      with_column(state, value, [&]< typename U >(const ColumnData& other)
+      {
+        column_zip< T, U >(column, other, [](T& y, U x) { y += x; });
+      });
+    touched(column, column.span());
+    return self;
+  }
+
+  static mrb_value scale(mrb_state* state, mrb_value self)
+  {
+    mrb_value value;
+    mrb_get_args(state, "o", &value);
+    const T a = scalar(state, value);
+    auto& column = written(state, self);
+    const auto span = column.span();
+    for(std::size_t i = 0; i < span.size; ++i)
+      column_at< T >(span, i) *= a;
+    touched(column, span);
+    return self;
+  }
+
+  // column.axpy(a, x) computes column += a * x
+  static mrb_value axpy(mrb_state* state, mrb_value self)
+  {
+    mrb_value a_value, x_value;
+    mrb_get_args(state, "oo", &a_value, &x_value);
+    const T a = scalar(state, a_value);
+    auto& column = written(state, self);
+    with_column(state, x_value, [&]< typename U >(const ColumnData& other)
+    {
+      column_zip< T, U >(column, other, [a](T& y, U x) { y += a * x; });
+    });
+    touched(column, column.span());
+    return self;
+  }
+
+  static mrb_value clamp(mrb_state* state, mrb_value self)
+  {
+    mrb_value lo_value, hi_value;
+    mrb_get_args(state, "oo", &lo_value, &hi_value);
+    const T lo = scalar(state, lo_value), hi = scalar(state, hi_value);
+    if(hi < lo)
+      mrb_raise(state, mrb_exc_get(state, "ArgumentError"), "min must not exceed max");
+    auto& column = written(state, self);
+    const auto span = column.span();
+    for(std::size_t i = 0; i < span.size; ++i)
+    {
+      T& y = column_at< T >(span, i);
+      y = std::min(std::max(y, lo), hi);
+    }
+    touched(column, span);
+    return self;
+  }
+
+  template< typename Fn >
+  static mrb_value reduce(mrb_state* state, mrb_value self, Fn&& fn)
+  {
+    const auto span = data(state, self).span();
+    if(! span.size)
+      return mrb_nil_value();
+    T result = column_at< T >(span, 0);
+    for(std::size_t i = 1; i < span.size; ++i)
+      result = fn(result, column_at< T >(span, i));
+    return mrb_float_value(state, result);
+  }
+
+  static mrb_value min(mrb_state* state, mrb_value self)
+  {
+    return reduce(state, self, [](T a, T b) { return std::min(a, b); });
+  }
+
+  static mrb_value max(mrb_state* state, mrb_value self)
+  {
+    return reduce(state, self, [](T a, T b) { return std::max(a, b); });
+  }
+
+  static mrb_value sum(mrb_state* state, mrb_value self)
+  {
+    const auto span = data(state, self).span();
+    double result = 0;
+    for(std::size_t i = 0; i < span.size; ++i)
+      result += column_at< T >(span, i);
+    return mrb_float_value(state, result);
+  }
+
+  static mrb_value dot(mrb_state* state, mrb_value self)
+  {
+    mrb_value value;
+    mrb_get_args(state, "o", &value);
+    auto& column = data(state, self);
+    double result = 0;
+    with_column(state, value, [&]< typename U >(const ColumnData& other)
+    {
+      column_zip< T, U >(column, other, [&result](T& y, U x) { result += double(y) * x; });
+    });
+    return mrb_float_value(state, result);
+  }
+};
+
+// Column classes are defined once per mrb_state, by RegistryMixin::mrb_init
+inline void define_columns(mrb_state* state)
+{
+  Column< float >::define(state);
+  Column< double >::define(state);
+}
+
+} // ::MRuby
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <mruby.h>
+#include <mruby/array.h>
+#include <mruby/error.h>
+
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+namespace MRuby
+{
+
+enum class EventKind : std::uint8_t
+{
+  construct,
+  update,
+  destroy
+};
+
+constexpr std::size_t event_kind_count = 3;
+
+struct EventQueue
+{
+  std::vector< entt::entity > entities;
+  // Slots in ComponentEvents::callbacks
+  std::vector< mrb_int > callbacks;
+  bool connected = false;
+};
+
+// Construct, update and destroy events of components that Ruby subscribed
+// to. Static components are fed by entt's signals, dynamic ones by
+// DynamicComponents. Events are buffered and handed to each callback once
+// per RegistryMixin::mrb_flush, as one Array of entity ids per component
+// and kind. Lives in the registry context.
+struct ComponentEvents
+{
+  mrb_state* state = nullptr;
+  // Subscribed blocks, rooted
+  mrb_value callbacks = mrb_nil_value();
+  // Indexed by component id * event_kind_count + kind
+  std::vector< EventQueue > queues;
+  // Worker VMs replace components from several threads
+  std::mutex mutex;
+
+  void init(mrb_state* state)
+  {
+    this->state = state;
+    callbacks = mrb_ary_new(state);
+    mrb_gc_register(state, callbacks);
+  }
+
+  static std::size_t index(mrb_int type, EventKind kind)
+  {
+    return static_cast< std::size_t >(type) * event_kind_count + static_cast< std::size_t >(kind);
+  }
+
+  std::size_t queue_count()
+  {
+    std::lock_guard< std::mutex > lock(mutex);
+    return queues.size();
+  }
+
+  EventQueue& queue(mrb_int type, EventKind kind)
+  {
+    const auto slot = index(type, kind);
+    if(slot >= queues.size())
+      queues.resize(slot + 1);
+    return queues[ slot ];
+  }
+
+  void subscribe(mrb_int type, EventKind kind, mrb_value block)
+  {
+    std::lock_guard< std::mutex > lock(mutex);
+    queue(type, kind).callbacks.push_back(RARRAY_LEN(callbacks));
+    mrb_ary_push(state, callbacks, block);
+  }
+
+  // True the first time it's called for a queue, when its entt signal
+  // needs connecting
+  bool mark_connected(mrb_int type, EventKind kind)
+  {
+    std::lock_guard< std::mutex > lock(mutex);
+    auto& queue = this->queue(type, kind);
+    if(queue.connected)
+      return false;
+    queue.connected = true;
+    return true;
+  }
+
+  void push(mrb_int type, EventKind kind, entt::entity entity)
+  {
+    const auto slot = index(type, kind);
+    std::lock_guard< std::mutex > lock(mutex);
+    if(slot < queues.size() && ! queues[ slot ].callbacks.empty())
+      queues[ slot ].entities.push_back(entity);
+  }
+
+  // entt listener, connected once a static component gets a subscriber
+  template< typename Component, EventKind Kind >
+  static void record(ComponentEvents& events, entt::registry&, entt::entity entity)
+  {
+    events.push(entt::type_seq< Component >::value(), Kind, entity);
+  }
+
+  template< typename Component >
+  static void connect(entt::registry& registry, ComponentEvents& events, EventKind kind)
+  {
+    switch(kind)
+    {
+      case EventKind::construct:
+        registry.on_construct< Component >().template connect< &record< Component, EventKind::construct > >(events);
+        break;
+      case EventKind::update:
+        registry.on_update< Component >().template connect< &record< Component, EventKind::update > >(events);
+        break;
+      case EventKind::destroy:
+        registry.on_destroy< Component >().template connect< &record< Component, EventKind::destroy > >(events);
+        break;
+    }
+  }
+
+  static mrb_value call_callback(mrb_state* state, mrb_value args)
+  {
+    return mrb_yield(state, RARRAY_PTR(args)[0], RARRAY_PTR(args)[1]);
+  }
+
+  // Yield each non-empty queue's entity ids, without duplicates, to its
+  // callbacks. Events raised by the callbacks wait for the next dispatch.
+  // A callback that raises is handed to on_error(exception) and the other
+  // callbacks still run, nothing unwinds through here.
+  template< typename OnError >
+  void dispatch(OnError&& on_error)
+  {
+    for(std::size_t slot = 0; slot < queue_count(); ++slot)
+    {
+      std::vector< entt::entity > entities;
+      {
+        std::lock_guard< std::mutex > lock(mutex);
+        entities.swap(queues[ slot ].entities);
+      }
+      if(entities.empty())
+        continue;
+
+      std::sort(entities.begin(), entities.end());
+      entities.erase(std::unique(entities.begin(), entities.end()), entities.end());
+
+      const int arena = mrb_gc_arena_save(state);
+      mrb_value ids = mrb_ary_new_capa(state, entities.size());
+      for(const auto entity : entities)
+        mrb_ary_push(state, ids, mrb_fixnum_value(std::underlying_type_t< entt::entity >(entity)));
+
+      // Copied, a callback may subscribe more callbacks
+      std::vector< mrb_int > subscribers;
+      {
+        std::lock_guard< std::mutex > lock(mutex);
+        subscribers = queues[ slot ].callbacks;
+      }
+      for(const auto callback : subscribers)
+      {
+        const mrb_value args[] = { mrb_ary_entry(callbacks, callback), ids };
+        mrb_bool raised = FALSE;
+        const mrb_value result = mrb_protect(state, call_callback, mrb_ary_new_from_values(state, 2, args), &raised);
+        if(raised)
+          on_error(result);
+      }
+      mrb_gc_arena_restore(state, arena);
+    }
+  }
+};
+
+} // ::MRuby
@@ -0,0 +1,380 @@
+#pragma once
+
+#include "mruby-bindings.h"
+#include "component-interface.h"
+#include "component-column.h"
+#include "component-sort.h"
+
+#include <mruby/hash.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <tuple>
+#include <utility>
+#include <type_traits>
+
+namespace MRuby
+{
+
+template< typename Component, typename Field >
+struct FieldDescriptor
+{
+  using component_type = Component;
+  using field_type = Field;
+
+  const char* name;
+  std::size_t name_size;
+  Field Component::* member;
+};
+
+template< typename Component, typename Field, std::size_t N >
+constexpr FieldDescriptor< Component, Field > field(const char (&name)[N], Field Component::* member)
+{
+  return { name, N - 1, member };
+}
+
+// Specialized with MRUBY_COMPONENT_REFLECT or MRUBY_COMPONENT_FIELDS, must
+// provide a constexpr tuple of FieldDescriptors called fields
+template< typename Component >
+struct ComponentFields;
+
+template< typename Component >
+constexpr std::size_t component_field_count =
+  std::tuple_size_v< std::decay_t< decltype(ComponentFields< Component >::fields) > >;
+
+template< typename Component, typename Fn, std::size_t... I >
+void visit_fields(Fn&& fn, std::index_sequence< I... >)
+{
+  (fn(std::integral_constant< std::size_t, I >{}, std::get< I >(ComponentFields< Component >::fields)), ...);
+}
+
+// Calls fn(index, descriptor) for every reflected field of Component
+template< typename Component, typename Fn >
+void visit_fields(Fn&& fn)
+{
+  visit_fields< Component >(fn, std::make_index_sequence< component_field_count< Component > >{});
+}
+
+// Field name symbols, interned once per mrb_state. Each thread drives a
+// single state at a time, so the cache is per thread.
+template< typename Component >
+struct FieldSymbols
+{
+  mrb_state* state = nullptr;
+  std::uint64_t closed = 0;
+  mrb_sym symbols[ component_field_count< Component > ];
+
+  static FieldSymbols& instance()
+  {
+    thread_local FieldSymbols cache;
+    return cache;
+  }
+
+  static const mrb_sym* get(mrb_state* state)
+  {
+    auto& cache = instance();
+    if(cache.state != state || cache.closed != closed_states.load(std::memory_order_relaxed))
+      intern(state);
+    return cache.symbols;
+  }
+
+  static void intern(mrb_state* state)
+  {
+    auto& cache = instance();
+    cache.state = state;
+    cache.closed = closed_states.load(std::memory_order_relaxed);
+    visit_fields< Component >([&](auto index, const auto& field)
+    {
+      cache.symbols[ index ] = mrb_intern_static(state, field.name, field.name_size);
+    });
+  }
+
+  // Index of the field named by sym, or -1
+  static mrb_int find(mrb_state* state, mrb_sym sym)
+  {
+    const mrb_sym* symbols = get(state);
+    for(std::size_t i = 0; i < component_field_count< Component >; ++i)
+      if(symbols[i] == sym)
+        return i;
+    return -1;
+  }
+};
+
+template< typename Component >
+mrb_value fields_to_hash(mrb_state* state, const Component& component)
+{
+  const mrb_sym* symbols = FieldSymbols< Component >::get(state);
+  mrb_value hash = mrb_hash_new_capa(state, component_field_count< Component >);
+  visit_fields< Component >([&](auto index, const auto& field)
+  {
+    mrb_value value;
+    if(to_mrb(state, component.*(field.member), value))
+      mrb_hash_set(state, hash, mrb_symbol_value(symbols[ index ]), value);
+  });
+  return hash;
+}
+
+template< typename Field >
+void field_from_mrb(mrb_state* state, const char* name, mrb_value value, Field& output)
+{
+  if(! from_mrb(state, value, output))
+  {
+    char message[128];
+    std::snprintf(message, sizeof(message), "invalid value for field %s", name);
+    mrb_raise(state, mrb_exc_get(state, "TypeError"), message);
+  }
+}
+
+// Reads the fields present in hash into component, others are left alone
+template< typename Component >
+void fields_from_hash(mrb_state* state, mrb_value hash, Component& component)
+{
+  const mrb_sym* symbols = FieldSymbols< Component >::get(state);
+  visit_fields< Component >([&](auto index, const auto& field)
+  {
+    mrb_value value = mrb_hash_fetch(state, hash, mrb_symbol_value(symbols[ index ]), mrb_undef_value());
+    if(! mrb_undef_p(value))
+      field_from_mrb(state, field.name, value, component.*(field.member));
+  });
+}
+
+// Reads one value per field, in declaration order
+template< typename Component >
+void fields_from_values(mrb_state* state, const mrb_value* values, Component& component)
+{
+  visit_fields< Component >([&](auto index, const auto& field)
+  {
+    field_from_mrb(state, field.name, values[ index ], component.*(field.member));
+  });
+}
+
+// ComponentInterface generated from a component's reflected fields.
+// get returns a Hash of field symbols, set accepts such a Hash or one
+// positional value per field. get_many and set_many use a Hash of
+// per-field Arrays instead, column views a float or double field.
+template< typename Component >
+struct FieldComponentInterface : DefaultComponentInterface< Component >
+{
+  static void init(mrb_state* state, RClass* ns)
+  {
+    FieldSymbols< Component >::intern(state);
+  }
+
+  static mrb_value get(mrb_state* state, entt::registry& registry, entt::entity entity, entt::id_type type)
+  {
+    if(auto component = registry.try_get< Component >(entity))
+      return fields_to_hash(state, *component);
+    return mrb_nil_value();
+  }
+
+  static mrb_value get_value(mrb_state* state, entt::registry& registry, entt::entity entity, const Component& component)
+  {
+    return fields_to_hash(state, component);
+  }
+
+  static mrb_value set(mrb_state* state, entt::registry& registry, entt::entity entity, entt::id_type type, mrb_int argc, mrb_value* argv)
+  {
+    const Component* existing = registry.try_get< Component >(entity);
+    Component component = existing ? *existing : Component{};
+
+    if(argc == 1 && mrb_hash_p(argv[0]))
+      fields_from_hash(state, argv[0], component);
+    else if(argc == static_cast< mrb_int >(component_field_count< Component >))
+      fields_from_values(state, argv, component);
+    else
+      return mrb_nil_value();
+
+    registry.emplace_or_replace< Component >(entity, component);
+    return argc == 1 ? argv[0] : mrb_true_value();
+  }
+
+  static entt::entity id_to_entity(mrb_state* state, mrb_value id)
+  {
+    if(! mrb_fixnum_p(id))
+      mrb_raise(state, mrb_exc_get(state, "TypeError"), "entity ids must be Integers");
+    return entt::entity(mrb_fixnum(id));
+  }
+
+  // Returns { field: [value, ...] } with one slot per id, nil where the
+  // entity is gone or lacks the component
+  static mrb_value get_many(mrb_state* state, entt::registry& registry, entt::id_type type, const std::vector< mrb_value >& ids)
+  {
+    constexpr auto count = component_field_count< Component >;
+    const mrb_sym* symbols = FieldSymbols< Component >::get(state);
+
+    mrb_value columns[ count ];
+    mrb_value result = mrb_hash_new_capa(state, count);
+    for(std::size_t i = 0; i < count; ++i)
+    {
+      columns[i] = mrb_ary_new_capa(state, ids.size());
+      mrb_hash_set(state, result, mrb_symbol_value(symbols[i]), columns[i]);
+    }
+
+    const int arena = mrb_gc_arena_save(state);
+    for(const auto id : ids)
+    {
+      const auto entity = id_to_entity(state, id);
+      const Component* component = registry.valid(entity)
+        ? registry.try_get< Component >(entity)
+        : nullptr;
+
+      visit_fields< Component >([&](auto index, const auto& field)
+      {
+        mrb_value value = mrb_nil_value();
+        if(component)
+          to_mrb(state, component->*(field.member), value);
+        mrb_ary_push(state, columns[ index ], value);
+      });
+      mrb_gc_arena_restore(state, arena);
+    }
+    return result;
+  }
+
+  // Takes the layout get_many returns. Missing columns leave those fields
+  // alone, invalid entities are skipped. Returns the number of entities set.
+  static mrb_value set_many(mrb_state* state, entt::registry& registry, entt::id_type type, const std::vector< mrb_value >& ids, mrb_value values)
+  {
+    constexpr auto count = component_field_count< Component >;
+    const mrb_sym* symbols = FieldSymbols< Component >::get(state);
+
+    mrb_value columns[ count ];
+    for(std::size_t i = 0; i < count; ++i)
+    {
+      columns[i] = mrb_hash_fetch(state, values, mrb_symbol_value(symbols[i]), mrb_undef_value());
+      if(mrb_undef_p(columns[i]))
+        continue;
+      if(! mrb_array_p(columns[i]) || RARRAY_LEN(columns[i]) < static_cast< mrb_int >(ids.size()))
+        mrb_raise(state, mrb_exc_get(state, "ArgumentError"), "each column needs one value per entity");
+    }
+
+    mrb_int updated = 0;
+    for(std::size_t n = 0; n < ids.size(); ++n)
+    {
+      const auto entity = id_to_entity(state, ids[n]);
+      if(! registry.valid(entity))
+        continue;
+
+      const Component* existing = registry.try_get< Component >(entity);
+      Component component = existing ? *existing : Component{};
+      visit_fields< Component >([&](auto index, const auto& field)
+      {
+        if(! mrb_undef_p(columns[ index ]))
+          field_from_mrb(state, field.name, RARRAY_PTR(columns[ index ])[n], component.*(field.member));
+      });
+      registry.emplace_or_replace< Component >(entity, component);
+      ++updated;
+    }
+    return mrb_fixnum_value(updated);
+  }
+
+  static mrb_value column(mrb_state* state, entt::registry& registry, entt::id_type type, mrb_sym name)
+  {
+    const auto index = FieldSymbols< Component >::find(state, name);
+    if(index < 0)
+      mrb_raise(state, mrb_exc_get(state, "IndexError"), "no such field");
+
+    mrb_value result = mrb_nil_value();
+    visit_fields< Component >([&](auto I, const auto& field)
+    {
+      using Field = typename std::decay_t< decltype(field) >::field_type;
+      constexpr auto member = std::get< decltype(I)::value >(ComponentFields< Component >::fields).member;
+      if constexpr(std::is_same_v< Field, float > || std::is_same_v< Field, double >)
+      {
+        if(static_cast< mrb_int >(I) == index)
+          result = Column< Field >::wrap(state, registry, ColumnAccess< Component, member >::source());
+      }
+    });
+
+    if(mrb_nil_p(result))
+      mrb_raise(state, mrb_exc_get(state, "TypeError"), "only float and double fields have columns");
+    return result;
+  }
+
+  // Sorts the storage by a field that has operator<
+  static mrb_value sort(mrb_state* state, entt::registry& registry, entt::id_type type, mrb_sym name, bool descending, bool incremental)
+  {
+    const auto index = FieldSymbols< Component >::find(state, name);
+    if(index < 0)
+      mrb_raise(state, mrb_exc_get(state, "IndexError"), "no such field");
+
+    bool sorted = false;
+    visit_fields< Component >([&](auto I, const auto& field)
+    {
+      using Field = typename std::decay_t< decltype(field) >::field_type;
+      constexpr auto member = std::get< decltype(I)::value >(ComponentFields< Component >::fields).member;
+      if constexpr(std::is_invocable_r_v< bool, std::less<>, const Field&, const Field& >)
+      {
+        if(static_cast< mrb_int >(I) != index)
+          return;
+        if(descending)
+          sort_storage< Component >(registry, [](const Component& lhs, const Component& rhs)
+          {
+            return rhs.*member < lhs.*member;
+          }, incremental);
+        else
+          sort_storage< Component >(registry, [](const Component& lhs, const Component& rhs)
+          {
+            return lhs.*member < rhs.*member;
+          }, incremental);
+        sorted = true;
+      }
+    });
+
+    if(! sorted)
+      mrb_raise(state, mrb_exc_get(state, "TypeError"), "field can't be compared");
+    return mrb_true_value();
+  }
+};
+
+} // ::MRuby
+
+#define MRUBY_FIELDS_EXPAND(x) x
+#define MRUBY_FIELDS_CONCAT_(a, b) a##b
+#define MRUBY_FIELDS_CONCAT(a, b) MRUBY_FIELDS_CONCAT_(a, b)
+
+#define MRUBY_FIELDS_COUNT_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, N, ...) N
+#define MRUBY_FIELDS_COUNT(...) \
+  MRUBY_FIELDS_EXPAND(MRUBY_FIELDS_COUNT_(__VA_ARGS__, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1))
+
+#define MRUBY_FIELDS_1(f, x) f(x)
+#define MRUBY_FIELDS_2(f, x, ...) f(x), MRUBY_FIELDS_EXPAND(MRUBY_FIELDS_1(f, __VA_ARGS__))
+#define MRUBY_FIELDS_3(f, x, ...) f(x), MRUBY_FIELDS_EXPAND(MRUBY_FIELDS_2(f, __VA_ARGS__))
+#define MRUBY_FIELDS_4(f, x, ...) f(x), MRUBY_FIELDS_EXPAND(MRUBY_FIELDS_3(f, __VA_ARGS__))
+#define MRUBY_FIELDS_5(f, x, ...) f(x), MRUBY_FIELDS_EXPAND(MRUBY_FIELDS_4(f, __VA_ARGS__))
+#define MRUBY_FIELDS_6(f, x, ...) f(x), MRUBY_FIELDS_EXPAND(MRUBY_FIELDS_5(f, __VA_ARGS__))
+#define MRUBY_FIELDS_7(f, x, ...) f(x), MRUBY_FIELDS_EXPAND(MRUBY_FIELDS_6(f, __VA_ARGS__))
+#define MRUBY_FIELDS_8(f, x, ...) f(x), MRUBY_FIELDS_EXPAND(MRUBY_FIELDS_7(f, __VA_ARGS__))
+#define MRUBY_FIELDS_9(f, x, ...) f(x), MRUBY_FIELDS_EXPAND(MRUBY_FIELDS_8(f, __VA_ARGS__))
+#define MRUBY_FIELDS_10(f, x, ...) f(x), MRUBY_FIELDS_EXPAND(MRUBY_FIELDS_9(f, __VA_ARGS__))
+#define MRUBY_FIELDS_11(f, x, ...) f(x), MRUBY_FIELDS_EXPAND(MRUBY_FIELDS_10(f, __VA_ARGS__))
+#define MRUBY_FIELDS_12(f, x, ...) f(x), MRUBY_FIELDS_EXPAND(MRUBY_FIELDS_11(f, __VA_ARGS__))
+#define MRUBY_FIELDS_13(f, x, ...) f(x), MRUBY_FIELDS_EXPAND(MRUBY_FIELDS_12(f, __VA_ARGS__))
+#define MRUBY_FIELDS_14(f, x, ...) f(x), MRUBY_FIELDS_EXPAND(MRUBY_FIELDS_13(f, __VA_ARGS__))
+#define MRUBY_FIELDS_15(f, x, ...) f(x), MRUBY_FIELDS_EXPAND(MRUBY_FIELDS_14(f, __VA_ARGS__))
+#define MRUBY_FIELDS_16(f, x, ...) f(x), MRUBY_FIELDS_EXPAND(MRUBY_FIELDS_15(f, __VA_ARGS__))
+
+#define MRUBY_FIELDS_MAP(f, ...) \
+  MRUBY_FIELDS_EXPAND(MRUBY_FIELDS_CONCAT(MRUBY_FIELDS_, MRUBY_FIELDS_COUNT(__VA_ARGS__))(f, __VA_ARGS__))
+
+#define MRUBY_FIELD_DESCRIPTOR(name) ::MRuby::field(#name, &type::name)
+
+// Declares the reflected fields of a component (up to 16)
+#define MRUBY_COMPONENT_REFLECT(Component, ...) \
+  template<> \
+  struct MRuby::ComponentFields< Component > \
+  { \
+    using type = Component; \
+    static constexpr auto fields = std::make_tuple( \
+      MRUBY_FIELDS_MAP(MRUBY_FIELD_DESCRIPTOR, __VA_ARGS__) \
+    ); \
+  };
+
+// Reflects a component's fields and generates its ComponentInterface
+#define MRUBY_COMPONENT_FIELDS(Component, ...) \
+  MRUBY_COMPONENT_REFLECT(Component, __VA_ARGS__) \
+  template<> \
+  struct MRuby::ComponentInterface< Component > : MRuby::FieldComponentInterface< Component > \
+  { \
+  };
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "mruby-bindings.h"
+#include "component-interface.h"
+
+#include <mruby/data.h>
+
+#include <vector>
+#include <type_traits>
+
+namespace MRuby
+{
+
+// An entt group the host declared, see RegistryMixin::mrb_define_group.
+// Groups are typed, scripts can only look up the ones declared from C++.
+struct ComponentGroup
+{
+  // Yields (id, components...) to block for every entity of the group.
+  // Component k, owned ones first, in declaration order, is passed as
+  // argv[1 + slots[k]].
+  using Each = void(*)(mrb_state*, entt::registry&, mrb_value block, mrb_value* argv, const std::size_t* slots);
+  using Size = std::size_t(*)(entt::registry&);
+
+  std::vector< mrb_int > owned, observed;
+  Each each;
+  Size size;
+};
+
+template< typename Owned, typename Observed >
+struct GroupAccess;
+
+template< typename... Owned, typename... Observed >
+struct GroupAccess< entt::type_list< Owned... >, entt::type_list< Observed... > >
+{
+  static constexpr std::size_t component_count = sizeof...(Owned) + sizeof...(Observed);
+
+  static auto group(entt::registry& registry)
+  {
+    return registry.template group< Owned... >(entt::get< Observed... >);
+  }
+
+  static std::size_t size(entt::registry& registry)
+  {
+    return group(registry).size();
+  }
+
+  // An owning group keeps its entities and the owned components at the
+  // front of the owned storages, in the same order, so owned values are
+  // read by index from the packed arrays
+  template< typename Component, bool IsOwned, typename Group >
+  static mrb_value value(mrb_state* state, entt::registry& registry, const Group& group, entt::entity entity, std::size_t pos)
+  {
+    if constexpr(std::is_empty_v< Component >)
+      return ComponentInterface< Component >::get(state, registry, entity, entt::type_seq< Component >::value());
+    else if constexpr(IsOwned)
+      return ComponentInterface< Component >::get_value(state, registry, entity, group.template raw< Component >()[ pos ]);
+    else
+      return ComponentInterface< Component >::get_value(state, registry, entity, group.template get< Component >(entity));
+  }
+
+  // Back to front like entt does. Structural changes are deferred while
+  // this runs, so the arrays stay put.
+  static void each(mrb_state* state, entt::registry& registry, mrb_value block, mrb_value* argv, const std::size_t* slots)
+  {
+    const auto group = GroupAccess::group(registry);
+    const entt::entity* entities = group.data();
+    const int arena = mrb_gc_arena_save(state);
+    for(auto pos = group.size(); pos; --pos)
+    {
+      const auto entity = entities[ pos - 1 ];
+      std::size_t k = 0;
+      argv[0] = mrb_fixnum_value(entt::to_integral(entity));
+      ((argv[ 1 + slots[ k++ ] ] = value< Owned, true >(state, registry, group, entity, pos - 1)), ...);
+      ((argv[ 1 + slots[ k++ ] ] = value< Observed, false >(state, registry, group, entity, pos - 1)), ...);
+      mrb_yield_argv(state, block, 1 + component_count, argv);
+      mrb_gc_arena_restore(state, arena);
+    }
+  }
+};
+
+// What a Group object holds, the buffers are reused by every each
+struct ComponentGroupData
+{
+  static constexpr std::size_t max_components = 16;
+
+  // The RegistryBinding of the group's mrb_state
+  void* binding;
+  ComponentGroup::Each each;
+  ComponentGroup::Size size;
+  std::size_t count;
+  std::size_t slots[ max_components ];
+  mrb_value argv[ max_components + 1 ];
+};
+
+template< typename T >
+struct GroupBinder
+{
+  static void free(mrb_state* state, void* ptr)
+  {
+    if(ptr)
+      mrb_free(state, ptr);
+  }
+
+  static mrb_data_type mrb_type;
+
+  static mrb_value init(mrb_state* state, mrb_value self)
+  {
+    mrb_raise(state, mrb_exc_get(state, "TypeError"), "groups are created by Registry#group");
+    return self;
+  }
+};
+template< typename T >
+mrb_data_type GroupBinder< T >::mrb_type{
+  "Group", GroupBinder< T >::free
+};
+
+} // ::MRuby
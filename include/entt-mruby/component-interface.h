@@ -2,6 +2,9 @@
 
 #include <mruby.h>
 
+#include <vector>
+#include <algorithm>
+
 namespace MRuby
 {
 
@@ -9,11 +12,46 @@ struct ComponentFunctionSet
 {
   using MrbFunction = mrb_value(*)(mrb_state*, entt::registry&, entt::entity, entt::id_type);
   using MrbFunctionWithArg = mrb_value(*)(mrb_state*, entt::registry&, entt::entity, entt::id_type, mrb_int, mrb_value*);
+  using MrbFunctionGetMany = mrb_value(*)(mrb_state*, entt::registry&, entt::id_type, const std::vector< mrb_value >&);
+  using MrbFunctionSetMany = mrb_value(*)(mrb_state*, entt::registry&, entt::id_type, const std::vector< mrb_value >&, mrb_value);
+  using MrbFunctionColumn = mrb_value(*)(mrb_state*, entt::registry&, entt::id_type, mrb_sym);
+  using MrbFunctionSort = mrb_value(*)(mrb_state*, entt::registry&, entt::id_type, mrb_sym, bool descending, bool incremental);
 
   MrbFunction has, get, remove;
   MrbFunctionWithArg set;
+
+  // Optional bulk access, null unless the interface provides them.
+  // Registry#get_many and #set_many fall back to get and set per entity.
+  MrbFunctionGetMany get_many;
+  MrbFunctionSetMany set_many;
+
+  // Optional, returns a column view over one numeric field
+  MrbFunctionColumn column;
+
+  // Optional, sorts the storage by one field
+  MrbFunctionSort sort;
+};
+
+// Function sets indexed by entt::type_seq. Sequence numbers are small and
+// dense, so dispatch is a bounds check and an index.
+struct ComponentFunctionMap
+{
+  std::vector< ComponentFunctionSet > sets;
+
+  ComponentFunctionSet& operator[] (std::size_t index)
+  {
+    if(index >= sets.size())
+      sets.resize(index + 1, ComponentFunctionSet{});
+    return sets[ index ];
+  }
+
+  ComponentFunctionSet* find(std::size_t index)
+  {
+    if(index < sets.size() && sets[ index ].get)
+      return &sets[ index ];
+    return nullptr;
+  }
 };
-using ComponentFunctionMap = std::unordered_map< mrb_int, ComponentFunctionSet >;
 
 
 template
@@ -23,17 +61,35 @@ template
 >
 void mrb_init_function_map(ComponentFunctionMap& map, entt::registry& registry)
 {
+  map.sets.reserve(std::max({ entt::type_seq< Components >::value()... }) + 1);
   ((map[ entt::type_seq< Components >::value() ] = {
     ComponentInterface< Components >::has,
     ComponentInterface< Components >::get,
     ComponentInterface< Components >::remove,
-    ComponentInterface< Components >::set
+    ComponentInterface< Components >::set,
+    ComponentInterface< Components >::get_many,
+    ComponentInterface< Components >::set_many,
+    ComponentInterface< Components >::column,
+    ComponentInterface< Components >::sort
   }), ...);
 }
 
+template< typename Component >
+struct ComponentInterface;
+
 template< typename Component >
 struct DefaultComponentInterface
 {
+  static constexpr ComponentFunctionSet::MrbFunctionGetMany get_many = nullptr;
+  static constexpr ComponentFunctionSet::MrbFunctionSetMany set_many = nullptr;
+  static constexpr ComponentFunctionSet::MrbFunctionColumn column = nullptr;
+  static constexpr ComponentFunctionSet::MrbFunctionSort sort = nullptr;
+
+  // Called once per mrb_state from RegistryMixin::mrb_init
+  static void init(mrb_state* state, RClass* ns)
+  {
+  }
+
   static mrb_value get(mrb_state* state, entt::registry& registry, entt::entity entity, entt::id_type type)
   {
     if(registry.has<Component>(entity))
@@ -41,6 +97,14 @@ struct DefaultComponentInterface
     return mrb_false_value();
   }
 
+  // What get returns, from a component already at hand. Groups use it to
+  // read straight from the storage; interfaces that can, convert the
+  // reference instead of looking the entity up again.
+  static mrb_value get_value(mrb_state* state, entt::registry& registry, entt::entity entity, const Component& component)
+  {
+    return ComponentInterface< Component >::get(state, registry, entity, entt::type_seq< Component >::value());
+  }
+
   static mrb_value set(mrb_state* state, entt::registry& registry, entt::entity entity, entt::id_type type, mrb_int argc, mrb_value* args)
   {
     registry.emplace_or_replace< Component >(entity);
@@ -80,6 +144,9 @@ struct ComponentInterface : DefaultComponentInterface< Component >
 #define MRUBY_COMPONENT_INTERFACE_END \
   };
 
+#define MRUBY_COMPONENT_INIT \
+  static void init(mrb_state* state, RClass* ns)
+
 #define MRUBY_COMPONENT_GET \
   static mrb_value get(mrb_state* state, entt::registry& registry, entt::entity entity, entt::id_type type)
 
@@ -0,0 +1,289 @@
+#pragma once
+
+#include "mruby-bindings.h"
+#include "component-fields.h"
+#include "write-mask.h"
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace MRuby
+{
+
+// A proxy refers to a component by entity, the entity's version is checked
+// on every access so a proxy to a destroyed entity raises instead of
+// reading a recycled slot.
+struct ComponentProxyData
+{
+  entt::registry* registry;
+  entt::entity entity;
+  const WriteMask* writes;
+};
+
+template< typename Component >
+struct ComponentProxyBinder
+{
+  static void free(mrb_state* state, void* ptr)
+  {
+    if(ptr)
+      mrb_free(state, ptr);
+  }
+
+  static std::string type_name;
+  static mrb_data_type mrb_type;
+
+  static mrb_value init(mrb_state* state, mrb_value self)
+  {
+    mrb_raise(state, mrb_exc_get(state, "TypeError"), "component proxies are created by Registry#get");
+    return self;
+  }
+};
+template< typename Component >
+std::string ComponentProxyBinder< Component >::type_name =
+  cpp_type_name_to_mrb(MRuby::type_name< Component >()) + "Proxy";
+template< typename Component >
+mrb_data_type ComponentProxyBinder< Component >::mrb_type{
+  ComponentProxyBinder< Component >::type_name.c_str(), ComponentProxyBinder< Component >::free
+};
+
+template< typename Component >
+struct ComponentProxy
+{
+  using Binder = ComponentProxyBinder< Component >;
+  using Getter = mrb_value(*)(mrb_state*, mrb_value);
+  using Setter = mrb_value(*)(mrb_state*, mrb_value, mrb_value);
+
+  struct ClassCache
+  {
+    mrb_state* state = nullptr;
+    std::uint64_t closed = 0;
+    RClass* klass = nullptr;
+  };
+
+  static ClassCache& cache()
+  {
+    thread_local ClassCache cache;
+    return cache;
+  }
+
+  static RClass* klass(mrb_state* state)
+  {
+    auto& cached = cache();
+    const auto closed = closed_states.load(std::memory_order_relaxed);
+    if(cached.state != state || cached.closed != closed)
+      cached = { state, closed, mrb_class_get(state, Binder::type_name.c_str()) };
+    return cached.klass;
+  }
+
+  static void define(mrb_state* state)
+  {
+    auto cls = MRuby::Class::bind< Component, ComponentProxyBinder >(
+      state, Binder::type_name.c_str(), state->object_class);
+
+    define_accessors(cls, std::make_index_sequence< component_field_count< Component > >{});
+    cls
+      .define_method("[]", index_get, MRB_ARGS_REQ(1))
+      .define_method("[]=", index_set, MRB_ARGS_REQ(2))
+      .define_method("to_h", to_h, MRB_ARGS_NONE())
+      .define_method("inspect", inspect, MRB_ARGS_NONE())
+      .define_method("valid?", valid, MRB_ARGS_NONE())
+      .define_method("entity_id", entity_id, MRB_ARGS_NONE())
+    ;
+
+    cache() = { state, closed_states.load(std::memory_order_relaxed), cls.self };
+  }
+
+  static mrb_value wrap(mrb_state* state, entt::registry& registry, entt::entity entity)
+  {
+    RData* object = Data_Wrap_Struct(state, klass(state), &Binder::mrb_type, nullptr);
+    auto data = (ComponentProxyData*)mrb_malloc(state, sizeof(ComponentProxyData));
+    data->registry = &registry;
+    data->entity = entity;
+    data->writes = write_mask(state);
+    object->data = data;
+    return mrb_obj_value(object);
+  }
+
+  static bool is_proxy(mrb_value value)
+  {
+    return mrb_type(value) == MRB_TT_DATA && DATA_TYPE(value) == &Binder::mrb_type;
+  }
+
+  static ComponentProxyData& data(mrb_state* state, mrb_value self)
+  {
+    return *DATA_GET_PTR(state, self, &Binder::mrb_type, ComponentProxyData);
+  }
+
+  static Component* try_deref(ComponentProxyData& proxy)
+  {
+    if(! proxy.registry->valid(proxy.entity))
+      return nullptr;
+    return proxy.registry->try_get< Component >(proxy.entity);
+  }
+
+  static Component& deref(mrb_state* state, mrb_value self)
+  {
+    if(auto component = try_deref(data(state, self)))
+      return *component;
+    mrb_raise(state, mrb_exc_get(state, "RuntimeError"), "stale component proxy");
+  }
+
+  template< std::size_t I >
+  static mrb_value get_field(mrb_state* state, mrb_value self)
+  {
+    const auto& field = std::get< I >(ComponentFields< Component >::fields);
+    mrb_value value = mrb_nil_value();
+    to_mrb(state, deref(state, self).*(field.member), value);
+    return value;
+  }
+
+  // Writes go through patch so on_update listeners see them, and are
+  // limited by the WriteMask like Registry#set
+  template< std::size_t I >
+  static mrb_value set_field_value(mrb_state* state, mrb_value self, mrb_value value)
+  {
+    const auto& field = std::get< I >(ComponentFields< Component >::fields);
+    typename std::decay_t< decltype(field) >::field_type input;
+    field_from_mrb(state, field.name, value, input);
+
+    deref(state, self);
+    auto& proxy = data(state, self);
+    check_write(state, proxy.writes, entt::type_seq< Component >::value());
+    proxy.registry->template patch< Component >(proxy.entity, [&](Component& component)
+    {
+      component.*(field.member) = input;
+    });
+    return value;
+  }
+
+  template< std::size_t I >
+  static mrb_value set_field(mrb_state* state, mrb_value self)
+  {
+    mrb_value value;
+    mrb_get_args(state, "o", &value);
+    return set_field_value< I >(state, self, value);
+  }
+
+  template< std::size_t... I >
+  static void define_accessors(MRuby::Class& cls, std::index_sequence< I... >)
+  {
+    ((cls
+      .define_method(std::get< I >(ComponentFields< Component >::fields).name, get_field< I >, MRB_ARGS_NONE())
+      .define_method((std::string(std::get< I >(ComponentFields< Component >::fields).name) + "=").c_str(), set_field< I >, MRB_ARGS_REQ(1))
+    ), ...);
+  }
+
+  template< std::size_t... I >
+  static constexpr std::array< Getter, sizeof...(I) > make_getters(std::index_sequence< I... >)
+  {
+    return {{ get_field< I >... }};
+  }
+
+  template< std::size_t... I >
+  static constexpr std::array< Setter, sizeof...(I) > make_setters(std::index_sequence< I... >)
+  {
+    return {{ set_field_value< I >... }};
+  }
+
+  static mrb_int field_index(mrb_state* state, mrb_value key)
+  {
+    mrb_int index = -1;
+    if(mrb_symbol_p(key))
+      index = FieldSymbols< Component >::find(state, mrb_symbol(key));
+    else if(mrb_string_p(key))
+      index = FieldSymbols< Component >::find(state, mrb_intern_str(state, key));
+    if(index < 0)
+      mrb_raise(state, mrb_exc_get(state, "IndexError"), "no such field");
+    return index;
+  }
+
+  // proxy[:x] and proxy[:x] = v, so Hash-style scripts keep working
+  static mrb_value index_get(mrb_state* state, mrb_value self)
+  {
+    static constexpr auto getters = make_getters(std::make_index_sequence< component_field_count< Component > >{});
+    mrb_value key;
+    mrb_get_args(state, "o", &key);
+    return getters[ field_index(state, key) ](state, self);
+  }
+
+  static mrb_value index_set(mrb_state* state, mrb_value self)
+  {
+    static constexpr auto setters = make_setters(std::make_index_sequence< component_field_count< Component > >{});
+    mrb_value key, value;
+    mrb_get_args(state, "oo", &key, &value);
+    return setters[ field_index(state, key) ](state, self, value);
+  }
+
+  static mrb_value to_h(mrb_state* state, mrb_value self)
+  {
+    return fields_to_hash(state, deref(state, self));
+  }
+
+  static mrb_value inspect(mrb_state* state, mrb_value self)
+  {
+    if(! try_deref(data(state, self)))
+      return mrb_str_new_cstr(state, "#<stale proxy>");
+    return mrb_inspect(state, to_h(state, self));
+  }
+
+  static mrb_value valid(mrb_state* state, mrb_value self)
+  {
+    return mrb_bool_value(try_deref(data(state, self)) != nullptr);
+  }
+
+  static mrb_value entity_id(mrb_state* state, mrb_value self)
+  {
+    return mrb_fixnum_value(std::underlying_type_t< entt::entity >(data(state, self).entity));
+  }
+};
+
+// ComponentInterface whose get returns a proxy into the component storage
+// instead of a Hash copy. set also accepts a proxy, copying its component.
+template< typename Component >
+struct ProxyComponentInterface : FieldComponentInterface< Component >
+{
+  using Proxy = ComponentProxy< Component >;
+
+  static void init(mrb_state* state, RClass* ns)
+  {
+    FieldComponentInterface< Component >::init(state, ns);
+    Proxy::define(state);
+  }
+
+  static mrb_value get(mrb_state* state, entt::registry& registry, entt::entity entity, entt::id_type type)
+  {
+    if(registry.has< Component >(entity))
+      return Proxy::wrap(state, registry, entity);
+    return mrb_nil_value();
+  }
+
+  static mrb_value get_value(mrb_state* state, entt::registry& registry, entt::entity entity, const Component& component)
+  {
+    return Proxy::wrap(state, registry, entity);
+  }
+
+  static mrb_value set(mrb_state* state, entt::registry& registry, entt::entity entity, entt::id_type type, mrb_int argc, mrb_value* argv)
+  {
+    if(argc == 1 && Proxy::is_proxy(argv[0]))
+    {
+      auto& source = Proxy::data(state, argv[0]);
+      if(source.registry == &registry && source.entity == entity)
+        return argv[0];
+      registry.emplace_or_replace< Component >(entity, Proxy::deref(state, argv[0]));
+      return argv[0];
+    }
+    return FieldComponentInterface< Component >::set(state, registry, entity, type, argc, argv);
+  }
+};
+
+} // ::MRuby
+
+// Reflects a component's fields and makes Registry#get return proxies
+#define MRUBY_COMPONENT_PROXY_FIELDS(Component, ...) \
+  MRUBY_COMPONENT_REFLECT(Component, __VA_ARGS__) \
+  template<> \
+  struct MRuby::ComponentInterface< Component > : MRuby::ProxyComponentInterface< Component > \
+  { \
+  };
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "mruby-bindings.h"
+#include "component-interface.h"
+#include "dynamic-components.h"
+
+#include <mruby/data.h>
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+namespace MRuby
+{
+
+// A query compiled by Registry#query. Its terms are resolved once: static
+// with and without terms become a runtime view kept for the query's
+// lifetime, dynamic ones pool pointers. each only walks them.
+struct ComponentQuery
+{
+  static constexpr std::size_t max_terms = 64;
+
+  // The RegistryBinding of the query's mrb_state
+  void* binding = nullptr;
+
+  // Static with terms, with the static without terms as its filter. Empty
+  // when every with term is dynamic. entt picks the storage it walks when
+  // the view is made, recompile a query whose storages changed a lot.
+  std::optional< entt::runtime_view > view;
+  // A static with term that has no storage, nothing can match
+  bool empty = false;
+
+  // Yielded terms, the with terms followed by the optional ones
+  std::vector< mrb_int > types;
+  std::vector< ComponentFunctionSet* > functions;
+  std::size_t required = 0;
+  // Bit i is set when yielded term i is a dynamic component, read from
+  // pools[i] instead of through its functions
+  std::uint64_t dynamic_mask = 0;
+  // A dynamic component's pool only exists once it was first set, null
+  // ones are looked up again by each
+  std::vector< DynamicPool* > pools;
+
+  // Without terms checked per entity: the dynamic ones, and the static
+  // ones when there is no view to filter them
+  std::vector< mrb_int > without;
+  std::vector< DynamicPool* > without_pools;
+
+  // Block arguments, reused by every call
+  std::vector< mrb_value > argv;
+
+  bool dynamic(std::size_t term) const
+  {
+    return (dynamic_mask >> term) & 1;
+  }
+};
+
+template< typename T >
+struct QueryBinder
+{
+  static void free(mrb_state* state, void* ptr)
+  {
+    if(ptr)
+    {
+      ((T*)ptr)->~T();
+      mrb_free(state, ptr);
+    }
+  }
+
+  static mrb_data_type mrb_type;
+
+  static mrb_value init(mrb_state* state, mrb_value self)
+  {
+    mrb_raise(state, mrb_exc_get(state, "TypeError"), "queries are created by Registry#query");
+    return self;
+  }
+};
+template< typename T >
+mrb_data_type QueryBinder< T >::mrb_type{
+  "Query", QueryBinder< T >::free
+};
+
+} // ::MRuby
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <algorithm>
+
+namespace MRuby
+{
+
+// Sort a static component's storage, so iterating it follows compare.
+// Incremental sorting is an insertion sort, close to linear on a storage
+// that is nearly sorted already, as when it's re-sorted every frame.
+template< typename Component, typename Compare >
+void sort_storage(entt::registry& registry, Compare compare, bool incremental)
+{
+  if(incremental)
+    registry.sort< Component >(std::move(compare), entt::insertion_sort{});
+  else
+    registry.sort< Component >(std::move(compare));
+}
+
+// Iteration order of one storage, by entity index. Entities missing from
+// it rank last.
+struct SortRanks
+{
+  static constexpr std::uint32_t missing = std::numeric_limits< std::uint32_t >::max();
+
+  std::vector< std::uint32_t > ranks;
+
+  void build(const entt::entity* entities, std::size_t size)
+  {
+    std::fill(ranks.begin(), ranks.end(), missing);
+    // entt iterates from the back of the packed array
+    for(std::size_t i = 0; i < size; ++i)
+    {
+      const auto index = entt::registry::entity(entities[i]);
+      if(index >= ranks.size())
+        ranks.resize(index + 1, missing);
+      ranks[ index ] = static_cast< std::uint32_t >(size - 1 - i);
+    }
+  }
+
+  std::uint32_t rank(entt::entity entity) const
+  {
+    const auto index = entt::registry::entity(entity);
+    return index < ranks.size() ? ranks[ index ] : missing;
+  }
+};
+
+// Sorting of one static component, indexed by entt::type_seq in the mixin
+struct ComponentSorter
+{
+  void(*ranks)(entt::registry&, SortRanks&);
+  void(*like)(entt::registry&, const SortRanks&, bool incremental);
+
+  template< typename Component >
+  static ComponentSorter make()
+  {
+    return {
+      [](entt::registry& registry, SortRanks& ranks)
+      {
+        const auto view = registry.view< Component >();
+        ranks.build(view.data(), view.size());
+      },
+      [](entt::registry& registry, const SortRanks& ranks, bool incremental)
+      {
+        sort_storage< Component >(registry, [&ranks](const entt::entity lhs, const entt::entity rhs)
+        {
+          return ranks.rank(lhs) < ranks.rank(rhs);
+        }, incremental);
+      }
+    };
+  }
+};
+
+} // ::MRuby
@@ -3,6 +3,7 @@
 #include <memory>
 #include <cxxabi.h>
 #include <string>
+#include <cctype>
 
 namespace MRuby
 {
@@ -34,4 +35,29 @@ namespace MRuby
     }
     return str;
   }
+
+  // Removes ::s and camel cases names (foo::bar::baz becomes FooBarBaz)
+  std::string cpp_type_name_to_mrb(const std::string& str)
+  {
+      std::string result;
+      auto capitalize = [](const std::string& s)->std::string
+      {
+          std::string res = s;
+          if(std::islower(res[0]))
+              res[0] = std::toupper(res[0]);
+          return res;
+      };
+      std::size_t start = 0;
+      std::size_t idx = str.find("::", start);
+      while(idx != std::string::npos && start < str.size())
+      {
+          result.append(capitalize(str.substr(start, idx-start)));
+          start = idx+2;
+          idx = str.find("::", start);
+      }
+      if(start < str.size())
+          result.append(capitalize(str.substr(start, str.size()-start)));
+    
+      return result;
+  }
 }
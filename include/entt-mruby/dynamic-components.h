@@ -1,13 +1,156 @@
 #pragma once
 
-#include <unordered_map>
+#include "component-events.h"
+#include "change-tracker.h"
+
+#include <memory>
+#include <vector>
 
 namespace MRuby
 {
 
+// Values of one dynamic component. The sparse set maps entities to dense
+// indices and the values sit at the same index of a Ruby Array, so the GC
+// only marks live values and removal stays O(1).
+struct DynamicPool
+{
+  entt::sparse_set entities;
+  mrb_value values;
+
+  std::size_t size() const
+  {
+    return entities.size();
+  }
+
+  const entt::entity* data() const
+  {
+    return entities.data();
+  }
+
+  // The sparse set doesn't check versions, so compare the packed entity
+  bool contains(entt::entity entity) const
+  {
+    return entities.contains(entity) && entities.data()[ entities.index(entity) ] == entity;
+  }
+
+  mrb_value get(entt::entity entity) const
+  {
+    return RARRAY_PTR(values)[ entities.index(entity) ];
+  }
+
+  void set(mrb_state* state, entt::entity entity, mrb_value value)
+  {
+    mrb_ary_set(state, values, entities.index(entity), value);
+  }
+
+  void emplace(mrb_state* state, entt::entity entity, mrb_value value)
+  {
+    entities.emplace(entity);
+    mrb_ary_push(state, values, value);
+  }
+
+  // Mirrors the sparse set's swap and pop
+  void remove(mrb_state* state, entt::entity entity)
+  {
+    const auto pos = entities.index(entity);
+    const auto last = entities.size() - 1;
+    if(pos != last)
+      mrb_ary_set(state, values, pos, RARRAY_PTR(values)[ last ]);
+    mrb_ary_pop(state, values);
+    entities.remove(entity);
+  }
+};
+
+// Dynamic component values, one pool per dynamic component id. Lives in the
+// registry context, set up by RegistryMixin::mrb_init. Every pool's value
+// array hangs off a single GC root.
 struct DynamicComponents
 {
-  std::unordered_map< mrb_int, mrb_value > components;
+  mrb_state* state = nullptr;
+  mrb_value roots = mrb_nil_value();
+  std::vector< std::unique_ptr< DynamicPool > > pools;
+  // Dynamic components raise their own events and track their own
+  // changes, entt doesn't see them
+  ComponentEvents* events = nullptr;
+  ChangeTracker* changes = nullptr;
+
+  void init(mrb_state* state)
+  {
+    this->state = state;
+    roots = mrb_ary_new(state);
+    mrb_gc_register(state, roots);
+  }
+
+  DynamicPool* pool(mrb_int type)
+  {
+    if(type < 0 || static_cast< std::size_t >(type) >= pools.size())
+      return nullptr;
+    return pools[ type ].get();
+  }
+
+  DynamicPool& assure(mrb_int type)
+  {
+    if(static_cast< std::size_t >(type) >= pools.size())
+      pools.resize(type + 1);
+    if(! pools[ type ])
+    {
+      pools[ type ] = std::make_unique< DynamicPool >();
+      pools[ type ]->values = mrb_ary_new(state);
+      mrb_ary_push(state, roots, pools[ type ]->values);
+    }
+    return *pools[ type ];
+  }
+
+  // Returns the pool holding a value for entity. A value left behind by an
+  // entity destroyed outside of the mixin is dropped once its slot is
+  // looked up.
+  DynamicPool* find(mrb_int type, entt::entity entity)
+  {
+    auto pool = this->pool(type);
+    if(!pool || ! pool->entities.contains(entity))
+      return nullptr;
+    if(! pool->contains(entity))
+    {
+      pool->remove(state, pool->data()[ pool->entities.index(entity) ]);
+      return nullptr;
+    }
+    return pool;
+  }
+
+  // Drop every dynamic component of an entity that is being destroyed
+  void remove_all(entt::entity entity)
+  {
+    for(std::size_t type = 0; type < pools.size(); ++type)
+    {
+      auto& pool = pools[ type ];
+      if(pool && pool->contains(entity))
+      {
+        pool->remove(state, entity);
+        notify(type, EventKind::destroy, entity);
+      }
+    }
+  }
+
+  // Drop every value, as when all entities are destroyed
+  void clear()
+  {
+    for(std::size_t type = 0; type < pools.size(); ++type)
+      if(auto& pool = pools[ type ])
+      {
+        for(std::size_t i = 0; i < pool->size(); ++i)
+          notify(type, EventKind::destroy, pool->data()[i]);
+        pool->entities.clear();
+        mrb_ary_clear(state, pool->values);
+      }
+  }
+
+  void notify(mrb_int type, EventKind kind, entt::entity entity)
+  {
+    if(events)
+      events->push(type, kind, entity);
+    if(changes && changes->tracked(type))
+      changes->mark(type, entity);
+  }
 };
 
 } // ::MRuby
@@ -16,52 +159,54 @@ MRUBY_COMPONENT_INTERFACE_BEGIN(MRuby::DynamicComponents)
 
   MRUBY_COMPONENT_GET
   {
-    auto& dyn = registry.get_or_emplace< DynamicComponents >(entity);
-    const auto iter = dyn.components.find(type);
-    if(iter == dyn.components.cend())
-      return mrb_nil_value();
-
-    return iter->second;
+    auto& dyn = registry.ctx< DynamicComponents >();
+    if(auto pool = dyn.find(type, entity))
+      return pool->get(entity);
+    return mrb_nil_value();
   }
 
   MRUBY_COMPONENT_SET
   {
-    auto& dyn = registry.get_or_emplace< DynamicComponents >(entity);
-    mrb_gc_unregister(state, dyn.components[type]);
+    auto& dyn = registry.ctx< DynamicComponents >();
+    mrb_value value;
     if(argc == 0)
-      dyn.components[type] = mrb_nil_value();
+      value = mrb_nil_value();
     else if(argc == 1)
-      dyn.components[type] = argv[0];
+      value = argv[0];
     else
-      dyn.components[type] = mrb_ary_new_from_values(state, argc, argv);
-    mrb_gc_register(state, dyn.components[type]);
-    return dyn.components[type];
+      value = mrb_ary_new_from_values(state, argc, argv);
+
+    if(auto pool = dyn.find(type, entity))
+    {
+      pool->set(state, entity, value);
+      dyn.notify(type, EventKind::update, entity);
+    }
+    else
+    {
+      dyn.assure(type).emplace(state, entity, value);
+      dyn.notify(type, EventKind::construct, entity);
+    }
+    return value;
   }
 
   MRUBY_COMPONENT_HAS
   {
-    auto& dyn = registry.get_or_emplace< DynamicComponents >(entity);
-    const auto iter = dyn.components.find(type);
-    if(iter == dyn.components.cend())
-      return mrb_false_value();
-
-    return mrb_true_value();
+    auto& dyn = registry.ctx< DynamicComponents >();
+    if(dyn.find(type, entity))
+      return mrb_true_value();
+    return mrb_false_value();
   }
 
   MRUBY_COMPONENT_REMOVE
   {
-    if(auto dyn = registry.try_get< DynamicComponents >(entity))
+    auto& dyn = registry.ctx< DynamicComponents >();
+    if(auto pool = dyn.find(type, entity))
     {
-      auto& components = dyn->components;
-      auto iter = components.find(type);
-      if(iter == components.cend())
-        return mrb_false_value();
-      mrb_gc_unregister(state, iter->second);
-      components.erase(iter);
+      pool->remove(state, entity);
+      dyn.notify(type, EventKind::destroy, entity);
       return mrb_true_value();
     }
     return mrb_false_value();
   }
 
 MRUBY_COMPONENT_INTERFACE_END
-
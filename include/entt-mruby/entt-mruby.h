@@ -6,4 +6,6 @@
 #include <entt/entt.hpp>
 
 #include "component-interface.h"
+#include "component-fields.h"
+#include "component-proxy.h"
 #include "registry-mixin.h"
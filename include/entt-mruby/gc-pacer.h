@@ -0,0 +1,205 @@
+#pragma once
+
+#include <mruby.h>
+#include <mruby/error.h>
+#include <mruby/variable.h>
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+namespace MRuby
+{
+
+// Pause times in power of two microsecond buckets: bucket 0 holds pauses
+// under 1us, bucket i pauses of [2^(i-1), 2^i) us, the last one the rest
+struct PauseHistogram
+{
+  static constexpr std::size_t bucket_count = 24;
+
+  std::array< std::uint64_t, bucket_count > buckets{};
+  std::uint64_t count = 0;
+  double max_seconds = 0, total_seconds = 0;
+
+  void add(double seconds)
+  {
+    const double us = seconds * 1e6;
+    std::size_t bucket = 0;
+    while(bucket + 1 < bucket_count && us >= double(std::uint64_t(1) << bucket))
+      ++bucket;
+    ++buckets[ bucket ];
+    ++count;
+    total_seconds += seconds;
+    if(seconds > max_seconds)
+      max_seconds = seconds;
+  }
+
+  // Upper bound of the bucket holding the p-th percentile, in microseconds
+  double percentile(double p) const
+  {
+    if(! count)
+      return 0;
+    const auto rank = static_cast< std::uint64_t >(p / 100.0 * (count - 1));
+    std::uint64_t seen = 0;
+    for(std::size_t i = 0; i < bucket_count; ++i)
+    {
+      seen += buckets[i];
+      if(seen > rank)
+        return double(std::uint64_t(1) << i);
+    }
+    return max_seconds * 1e6;
+  }
+
+  void clear()
+  {
+    *this = PauseHistogram{};
+  }
+};
+
+struct GCPacerStats
+{
+  // One pause per step() call that did any work
+  PauseHistogram pauses;
+  std::uint64_t steps = 0, cycles = 0;
+  // Full collections forced because stepping fell too far behind
+  std::uint64_t forced = 0;
+};
+
+// Moves mruby's garbage collection to a point of the frame chosen by the
+// host. While pacing, collection during allocation is off and step() does
+// incremental work until its time budget runs out. A cycle is started
+// when mruby would have started one on its own, live objects above the
+// GC threshold; if live objects outgrow the threshold by max_debt, a full
+// collection keeps memory bounded. GC.enable and GC.disable are replaced
+// so that, while pacing, they record the script's wish in user_disabled
+// instead of turning collection during allocation back on.
+struct GCPacer
+{
+  mrb_state* state = nullptr;
+  bool pacing = false;
+  // Whether the script wants the GC disabled, while pacing. Given back
+  // to mruby when pacing stops.
+  bool user_disabled = false;
+  double max_debt = 2.0;
+  GCPacerStats stats;
+
+  void init(mrb_state* state)
+  {
+    this->state = state;
+    RClass* gc = mrb_module_get(state, "GC");
+    mrb_iv_set(state, mrb_obj_value(gc), mrb_intern_lit(state, "pacer"), mrb_cptr_value(state, this));
+    mrb_define_class_method(state, gc, "enable", gc_enable, MRB_ARGS_NONE());
+    mrb_define_class_method(state, gc, "disable", gc_disable, MRB_ARGS_NONE());
+  }
+
+  // GC.enable and GC.disable, both return whether the GC was disabled
+  static mrb_value set_disabled(mrb_state* state, mrb_value gc, bool disabled)
+  {
+    const mrb_value pacer = mrb_iv_get(state, gc, mrb_intern_lit(state, "pacer"));
+    auto self = mrb_cptr_p(pacer) ? (GCPacer*)mrb_cptr(pacer) : nullptr;
+    bool was;
+    if(self && self->pacing)
+    {
+      was = self->user_disabled;
+      self->user_disabled = disabled;
+    }
+    else
+    {
+      was = state->gc.disabled;
+      state->gc.disabled = disabled;
+    }
+    return mrb_bool_value(was);
+  }
+
+  static mrb_value gc_enable(mrb_state* state, mrb_value self)
+  {
+    return set_disabled(state, self, false);
+  }
+
+  static mrb_value gc_disable(mrb_state* state, mrb_value self)
+  {
+    return set_disabled(state, self, true);
+  }
+
+  void pace(bool enable)
+  {
+    if(enable == pacing)
+      return;
+    if(enable)
+      user_disabled = state->gc.disabled;
+    pacing = enable;
+    state->gc.disabled = enable ? TRUE : user_disabled;
+  }
+
+  // Switch between generational and plain incremental collection, through
+  // GC.generational_mode= so mruby can finish the running cycle first. The
+  // disabled flag is restored even when that raises.
+  void generational(bool enable)
+  {
+    struct Context
+    {
+      mrb_state* state;
+      bool enable, disabled;
+    };
+    Context context{ state, enable, static_cast< bool >(state->gc.disabled) };
+    state->gc.disabled = FALSE;
+
+    mrb_ensure(state,
+      [](mrb_state* state, mrb_value data)
+      {
+        const auto context = (Context*)mrb_cptr(data);
+        return mrb_funcall(state, mrb_obj_value(mrb_module_get(state, "GC")), "generational_mode=", 1,
+          mrb_bool_value(context->enable));
+      },
+      mrb_cptr_value(state, &context),
+      [](mrb_state* state, mrb_value data)
+      {
+        state->gc.disabled = ((Context*)mrb_cptr(data))->disabled;
+        return mrb_nil_value();
+      },
+      mrb_cptr_value(state, &context));
+  }
+
+  bool needs_work() const
+  {
+    return state->gc.state != MRB_GC_STATE_ROOT || state->gc.live > state->gc.threshold;
+  }
+
+  // Run GC steps for up to budget. Returns the number of steps taken, none
+  // while a script has disabled the GC.
+  std::size_t step(std::chrono::microseconds budget)
+  {
+    const bool disabled_by_user = pacing ? user_disabled : state->gc.disabled;
+    if(disabled_by_user || ! needs_work() || state->gc.iterating)
+      return 0;
+
+    const auto start = std::chrono::steady_clock::now();
+    const auto deadline = start + budget;
+    const bool disabled = state->gc.disabled;
+    state->gc.disabled = FALSE;
+
+    std::size_t steps = 0;
+    if(state->gc.live > state->gc.threshold * max_debt)
+    {
+      mrb_full_gc(state);
+      ++stats.forced;
+      ++stats.cycles;
+    }
+    else
+      do
+      {
+        mrb_incremental_gc(state);
+        ++steps;
+        if(state->gc.state == MRB_GC_STATE_ROOT)
+          ++stats.cycles;
+      }
+      while(needs_work() && std::chrono::steady_clock::now() < deadline);
+
+    state->gc.disabled = disabled;
+    stats.steps += steps;
+    stats.pauses.add(std::chrono::duration< double >(std::chrono::steady_clock::now() - start).count());
+    return steps;
+  }
+};
+
+} // ::MRuby
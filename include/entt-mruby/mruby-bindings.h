@@ -14,6 +14,8 @@
 
 #include <iostream>
 
+#include <atomic>
+#include <cstdint>
 #include <vector>
 
 namespace MRuby
@@ -77,6 +79,20 @@ namespace MRuby
     return true;
   }
 
+  template<>
+  bool to_mrb< double >(mrb_state* state, const double& input, mrb_value& output)
+  {
+    output = mrb_float_value(state, input);
+    return true;
+  }
+
+  template<>
+  bool to_mrb< bool >(mrb_state* state, const bool& input, mrb_value& output)
+  {
+    output = mrb_bool_value(input);
+    return true;
+  }
+
   template<>
   bool to_mrb< mrb_int >(mrb_state* state, const mrb_int& input, mrb_value& output)
   {
@@ -165,6 +181,22 @@ namespace MRuby
     return false;
   }
 
+  template<>
+  bool from_mrb<double>(mrb_state* state, mrb_value input, double& output)
+  {
+    if(mrb_float_p(input))
+    {
+      output = mrb_float(input);
+      return true;
+    }
+    if(mrb_fixnum_p(input))
+    {
+      output = (double)mrb_fixnum(input);
+      return true;
+    }
+    return false;
+  }
+
   template<>
   bool from_mrb<mrb_int>(mrb_state* state, mrb_value input, mrb_int& output)
   {
@@ -325,4 +357,19 @@ namespace MRuby
       return mrb_obj_new(state, self, argc, argv);
     }
   };
+
+  // Counts the mrb_states closed so far. A new state may be allocated where
+  // a closed one was, so caches keyed by mrb_state* also compare this.
+  inline std::atomic< std::uint64_t > closed_states{ 0 };
+
+  inline mrb_data_type state_close_watch_type{
+    "StateCloseWatch", [](mrb_state*, void*) { closed_states.fetch_add(1, std::memory_order_relaxed); }
+  };
+
+  // Roots an object freed by mrb_close, call once for every state
+  inline void watch_state_close(mrb_state* state)
+  {
+    RData* watch = Data_Wrap_Struct(state, state->object_class, &state_close_watch_type, nullptr);
+    mrb_gc_register(state, mrb_obj_value(watch));
+  }
 }
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <mruby.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+namespace MRuby
+{
+
+struct AllocatorStats
+{
+  std::size_t allocations = 0, frees = 0, reallocations = 0;
+  // Allocations served from a free list instead of carving a new block
+  std::size_t reused = 0;
+  // Allocations too large for a size class, passed to malloc
+  std::size_t large = 0;
+  std::size_t bytes_in_use = 0, peak_bytes = 0;
+  std::size_t chunk_bytes = 0;
+};
+
+// mrb_allocf for one mrb_state. Small blocks, which is nearly everything
+// mruby allocates per frame (object slots aside: hash tables, string and
+// array buffers, iv tables), come from per-size-class free lists carved
+// out of large chunks. Freed blocks go back to their list; chunks are
+// released with the allocator, so it must outlive the state. Not thread
+// safe, a state is only used by one thread at a time.
+struct PoolAllocator
+{
+  // Every block is preceded by its size, padded to keep 16 byte alignment
+  static constexpr std::size_t header = 16;
+  static constexpr std::size_t granularity = 16;
+  static constexpr std::size_t max_small = 512;
+  static constexpr std::size_t class_count = max_small / granularity;
+  static constexpr std::size_t chunk_size = 256 * 1024;
+
+  struct FreeBlock
+  {
+    FreeBlock* next;
+  };
+
+  FreeBlock* free_lists[ class_count ] = {};
+  std::vector< void* > chunks;
+  char* bump = nullptr;
+  char* bump_end = nullptr;
+  AllocatorStats stats;
+
+  PoolAllocator() = default;
+  PoolAllocator(const PoolAllocator&) = delete;
+  PoolAllocator& operator= (const PoolAllocator&) = delete;
+
+  ~PoolAllocator()
+  {
+    for(auto chunk : chunks)
+      std::free(chunk);
+  }
+
+  static void* allocf(mrb_state*, void* ptr, std::size_t size, void* ud)
+  {
+    auto& self = *static_cast< PoolAllocator* >(ud);
+    if(size == 0)
+    {
+      self.deallocate(ptr);
+      return nullptr;
+    }
+    if(! ptr)
+      return self.allocate(size);
+    return self.reallocate(ptr, size);
+  }
+
+  static std::size_t rounded(std::size_t size)
+  {
+    return (size + granularity - 1) & ~(granularity - 1);
+  }
+
+  static std::size_t& block_size(void* ptr)
+  {
+    return *reinterpret_cast< std::size_t* >(static_cast< char* >(ptr) - header);
+  }
+
+  void* allocate(std::size_t size)
+  {
+    ++stats.allocations;
+    const auto block = rounded(size);
+    char* base;
+    if(block > max_small)
+    {
+      ++stats.large;
+      base = static_cast< char* >(std::malloc(header + block));
+      if(! base)
+        return nullptr;
+    }
+    else if(auto& list = free_lists[ block / granularity - 1 ])
+    {
+      ++stats.reused;
+      base = reinterpret_cast< char* >(list) - header;
+      list = list->next;
+    }
+    else
+    {
+      if(bump_end - bump < static_cast< std::ptrdiff_t >(header + block) && ! grow())
+        return nullptr;
+      base = bump;
+      bump += header + block;
+    }
+
+    *reinterpret_cast< std::size_t* >(base) = block;
+    stats.bytes_in_use += block;
+    stats.peak_bytes = std::max(stats.peak_bytes, stats.bytes_in_use);
+    return base + header;
+  }
+
+  void deallocate(void* ptr)
+  {
+    if(! ptr)
+      return;
+    ++stats.frees;
+    const auto block = block_size(ptr);
+    stats.bytes_in_use -= block;
+    if(block > max_small)
+    {
+      std::free(static_cast< char* >(ptr) - header);
+      return;
+    }
+    auto& list = free_lists[ block / granularity - 1 ];
+    auto freed = static_cast< FreeBlock* >(ptr);
+    freed->next = list;
+    list = freed;
+  }
+
+  void* reallocate(void* ptr, std::size_t size)
+  {
+    ++stats.reallocations;
+    const auto old_block = block_size(ptr);
+    const auto block = rounded(size);
+    if(block == old_block)
+      return ptr;
+
+    if(old_block > max_small && block > max_small)
+    {
+      char* base = static_cast< char* >(std::realloc(static_cast< char* >(ptr) - header, header + block));
+      if(! base)
+        return nullptr;
+      *reinterpret_cast< std::size_t* >(base) = block;
+      stats.bytes_in_use += block - old_block;
+      stats.peak_bytes = std::max(stats.peak_bytes, stats.bytes_in_use);
+      return base + header;
+    }
+
+    void* moved = allocate(size);
+    if(! moved)
+      return nullptr;
+    std::memcpy(moved, ptr, std::min(old_block, block));
+    deallocate(ptr);
+    // Counted as a reallocation, not as an allocation and a free
+    --stats.allocations;
+    --stats.frees;
+    return moved;
+  }
+
+private:
+  bool grow()
+  {
+    void* chunk = std::malloc(chunk_size);
+    if(! chunk)
+      return false;
+    chunks.push_back(chunk);
+    stats.chunk_bytes += chunk_size;
+    bump = static_cast< char* >(chunk);
+    bump_end = bump + chunk_size;
+    return true;
+  }
+};
+
+} // ::MRuby
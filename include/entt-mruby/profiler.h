@@ -0,0 +1,206 @@
+#pragma once
+
+#include <mruby.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <functional>
+
+// Instrumentation of the Registry bindings, compiled in by defining
+// ENTT_MRUBY_PROFILE. Without it the macros expand to nothing and the
+// registry has no profiler.
+#ifdef ENTT_MRUBY_PROFILE
+#define ENTT_MRUBY_PROFILE_SCOPE(registry, binding, type) \
+  ::MRuby::ProfileScope _mrb_profile_scope{ (registry)->mrb_profiler, ::MRuby::ProfiledBinding::binding, (type), mrb }
+#define ENTT_MRUBY_PROFILE_YIELD() ++_mrb_profile_scope.yielded
+#else
+#define ENTT_MRUBY_PROFILE_SCOPE(registry, binding, type)
+#define ENTT_MRUBY_PROFILE_YIELD()
+#endif
+
+namespace MRuby
+{
+
+enum class ProfiledBinding : std::uint8_t
+{
+  get,
+  set,
+  has,
+  remove,
+  entities,
+  create
+};
+
+constexpr std::size_t profiled_binding_count = 6;
+
+inline const char* profiled_binding_name(ProfiledBinding binding)
+{
+  static const char* names[ profiled_binding_count ] = {
+    "get", "set", "has", "remove", "entities", "create"
+  };
+  return names[ static_cast< std::size_t >(binding) ];
+}
+
+struct BindingCounters
+{
+  std::uint64_t calls = 0, nanoseconds = 0;
+  // Net growth of live Ruby objects, a GC step inside a call hides some
+  std::uint64_t objects = 0;
+  // Entities handed to the block, entities only
+  std::uint64_t yielded = 0;
+};
+
+struct TraceEvent
+{
+  ProfiledBinding binding;
+  mrb_int type;
+  std::uint64_t thread;
+  std::int64_t start, duration;
+};
+
+// Counters per binding and component id, plus an optional log of every
+// call for the Chrome trace viewer (chrome://tracing, Perfetto)
+struct Profiler
+{
+  using clock = std::chrono::steady_clock;
+
+  // Per binding, indexed by component id + 1, calls without a component
+  // go to slot 0
+  std::vector< BindingCounters > counters[ profiled_binding_count ];
+  std::vector< TraceEvent > trace;
+  bool tracing = false;
+  std::size_t trace_limit = 1 << 20;
+  clock::time_point epoch = clock::now();
+  // Worker VMs call bindings from several threads
+  std::mutex mutex;
+
+  void record(ProfiledBinding binding, mrb_int type, clock::time_point start, clock::time_point end,
+    std::uint64_t objects, std::uint64_t yielded)
+  {
+    const auto slot = static_cast< std::size_t >(type < 0 ? 0 : type + 1);
+    const auto duration = std::chrono::duration_cast< std::chrono::nanoseconds >(end - start).count();
+
+    std::lock_guard< std::mutex > lock(mutex);
+    auto& table = counters[ static_cast< std::size_t >(binding) ];
+    if(slot >= table.size())
+      table.resize(slot + 1);
+    auto& entry = table[ slot ];
+    ++entry.calls;
+    entry.nanoseconds += duration;
+    entry.objects += objects;
+    entry.yielded += yielded;
+
+    if(tracing && trace.size() < trace_limit)
+      trace.push_back({
+        binding, type,
+        std::hash< std::thread::id >{}(std::this_thread::get_id()),
+        std::chrono::duration_cast< std::chrono::nanoseconds >(start - epoch).count(),
+        duration
+      });
+  }
+
+  void reset()
+  {
+    std::lock_guard< std::mutex > lock(mutex);
+    for(auto& table : counters)
+      table.clear();
+    trace.clear();
+    epoch = clock::now();
+  }
+
+  // Calls fn(binding, type, counters) for every binding and component seen
+  template< typename Fn >
+  void each(Fn&& fn)
+  {
+    std::lock_guard< std::mutex > lock(mutex);
+    for(std::size_t binding = 0; binding < profiled_binding_count; ++binding)
+      for(std::size_t slot = 0; slot < counters[ binding ].size(); ++slot)
+        if(counters[ binding ][ slot ].calls)
+          fn(static_cast< ProfiledBinding >(binding), mrb_int(slot) - 1, counters[ binding ][ slot ]);
+  }
+
+  void start_trace()
+  {
+    std::lock_guard< std::mutex > lock(mutex);
+    tracing = true;
+  }
+
+  // Stops tracing and hands over the calls recorded so far
+  std::vector< TraceEvent > take_trace()
+  {
+    std::lock_guard< std::mutex > lock(mutex);
+    tracing = false;
+    std::vector< TraceEvent > events;
+    events.swap(trace);
+    return events;
+  }
+
+  // Writes the recorded calls as Chrome trace JSON, name(type) labels
+  // component ids
+  template< typename Name >
+  bool write_chrome_trace(const std::string& path, Name&& name)
+  {
+    std::lock_guard< std::mutex > lock(mutex);
+    return write_chrome_trace(path, trace, std::forward< Name >(name));
+  }
+
+  template< typename Name >
+  static bool write_chrome_trace(const std::string& path, const std::vector< TraceEvent >& trace, Name&& name)
+  {
+    std::FILE* file = std::fopen(path.c_str(), "w");
+    if(! file)
+      return false;
+
+    std::fputs("{\"traceEvents\":[", file);
+    for(std::size_t i = 0; i < trace.size(); ++i)
+    {
+      const auto& event = trace[i];
+      std::string category;
+      for(const char c : std::string(name(event.type)))
+      {
+        if(c == '"' || c == '\\')
+          category += '\\';
+        if(static_cast< unsigned char >(c) >= 0x20)
+          category += c;
+      }
+      std::fprintf(file,
+        "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+        "\"pid\":0,\"tid\":%llu,\"args\":{\"component\":%lld}}",
+        i ? "," : "",
+        profiled_binding_name(event.binding),
+        category.c_str(),
+        event.start / 1e3, event.duration / 1e3,
+        static_cast< unsigned long long >(event.thread % 1000000),
+        static_cast< long long >(event.type));
+    }
+    std::fputs("\n],\"displayTimeUnit\":\"ns\"}\n", file);
+    return std::fclose(file) == 0;
+  }
+};
+
+// Times one binding call, recorded when it returns normally
+struct ProfileScope
+{
+  Profiler& profiler;
+  ProfiledBinding binding;
+  mrb_int type;
+  mrb_state* state;
+  std::uint64_t yielded = 0;
+  std::size_t live = state->gc.live;
+  Profiler::clock::time_point start = Profiler::clock::now();
+
+  ~ProfileScope()
+  {
+    const auto end = Profiler::clock::now();
+    const auto now_live = state->gc.live;
+    profiler.record(binding, type, start, end, now_live > live ? now_live - live : 0, yielded);
+  }
+};
+
+} // ::MRuby
@@ -2,12 +2,31 @@
 
 #include "mruby-bindings.h"
 #include "dynamic-components.h"
+#include "bytecode-cache.h"
+#include "script-watcher.h"
+#include "component-column.h"
+#include "component-proxy.h"
+#include "write-mask.h"
+#include "component-group.h"
+#include "component-query.h"
+#include "component-sort.h"
+#include "scheduler.h"
+#include "vm-pool.h"
+#include "command-buffer.h"
+#include "snapshot.h"
+#include "profiler.h"
+#include "pool-allocator.h"
+#include "gc-pacer.h"
 
 #include <iterator>
 #include <mruby/array.h>
 #include <mruby/proc.h>
 #include <mruby/error.h>
 #include <iostream>
+#include <cstdio>
+#include <exception>
+#include <unordered_map>
+#include <stdexcept>
 
 namespace MRuby
 {
@@ -45,92 +64,50 @@ struct WeakPointer
   }
 };
 
-const char* mruby_api = R"MRUBY(
-class Entity
-  def initialize registry, id
-    @registry = registry
-    @id = id
-  end
-
-  attr_reader :registry, :id
-
-  def valid?
-    registry.valid? id
-  end
-
-  def get component
-    registry.get id, registry.component_id(component)
-  end
+// What the Registry object of one mrb_state points at
+template< typename T >
+struct RegistryBinding : WeakPointer< T >
+{
+  // Component ids by mrb_sym, filled as names are first resolved. A map,
+  // short names are packed into the symbol value itself so syms are far
+  // from dense. Symbols only mean something in their own mrb_state, hence
+  // per binding.
+  std::unordered_map< mrb_sym, mrb_int > symbol_ids;
+
+  // Set for the VMs of a VMPool. They only reach static components and may
+  // only replace the ones their running system writes.
+  bool worker = false;
+  WriteMask writes;
+
+  // Entity of the same mrb_state, whose handles find this binding through
+  // a hidden class variable
+  RClass* entity_class = nullptr;
+};
 
-  def set component, *args
-    registry.set id, registry.component_id(component), *args
-  end
+// Entity handles keep the entity itself, id and version, in their data
+// pointer. Making one allocates nothing besides the object and there is
+// nothing to free.
+inline mrb_data_type mrb_entity_data_type{ "Entity", nullptr };
 
-  def remove component
-    registry.remove id, registry.component_id(component)
-  end
+inline void* mrb_entity_pack(entt::entity entity)
+{
+  return reinterpret_cast< void* >(static_cast< std::uintptr_t >(entt::to_integral(entity)));
+}
 
-  def has? component
-    registry.has? id, registry.component_id(component)
-  end
-end
+inline entt::entity mrb_entity_unpack(void* data)
+{
+  return entt::entity(static_cast< std::underlying_type_t< entt::entity > >(reinterpret_cast< std::uintptr_t >(data)));
+}
 
+const char* mruby_api = R"MRUBY(
 class Registry
-  
-  def create_entity
-    Entity.new self, create
-  end
-
-  def component_id id
-    id === Fixnum ? id : component(id)
-  end
-
-  def get_component entity_id, component
-    get entity_id, component_id(component)
-  end
-
-  def set_component entity_id, component, *args
-    set entity_id, component_id(component), *args
-  end
-
-  def entity id
-    Entity.new self, id
-  end
-
-  def each_entity *args, &block
-    args = args.map {|id| component_id id }
-    entities(*args) do |entity_id|
-      yield entity entity_id
-    end
+  # system "move", reads: [:Velocity], writes: [:Transform] do |registry, dt|
+  def system name, options = {}, &block
+    add_system name, options[:reads], options[:writes], &block
   end
 end
 )MRUBY";
 
-// Removes ::s and camel cases names (foo::bar::baz becomes FooBarBaz)
-std::string cpp_type_name_to_mrb(const std::string& str)
-{
-    std::string result;
-    auto capitalize = [](const std::string& s)->std::string
-    {
-        std::string res = s;
-        if(std::islower(res[0]))
-            res[0] = std::toupper(res[0]);
-        return res;
-    };
-    std::size_t start = 0;
-    std::size_t idx = str.find("::", start);
-    while(idx != std::string::npos && start < str.size())
-    {
-        result.append(capitalize(str.substr(start, idx-start)));
-        start = idx+2;
-        idx = str.find("::", start);
-    }
-    if(start < str.size())
-        result.append(capitalize(str.substr(start, str.size()-start)));
-    
-    return result;
-}
-
 template< typename Derived >
 struct RegistryMixin
 {
@@ -156,11 +133,18 @@ struct RegistryMixin
     };
   }
 
+  using MRubyRegistryPtr = MRuby::RegistryBinding< Derived >;
+
   Derived& derived()
   {
     return *static_cast< Derived* >(this);
   }
 
+  static MRubyRegistryPtr* mrb_value_to_binding(mrb_state* mrb, mrb_value value)
+  {
+    return DATA_CHECK_GET_PTR(mrb, value, &::MRuby::DefaultClassBinder< MRubyRegistryPtr >::mrb_type, MRubyRegistryPtr);
+  }
+
   static Derived* mrb_value_to_registry(mrb_state* mrb, mrb_value value)
   {
     auto p = DATA_CHECK_GET_PTR(mrb, value, &::MRuby::DefaultClassBinder< MRubyRegistryPtr >::mrb_type, MRubyRegistryPtr);
@@ -181,41 +165,144 @@ struct RegistryMixin
     "Registry", mrb_registry_free
   };
 
+  // Declared first so it outlives anything else holding mruby memory
+  PoolAllocator mrb_allocator;
   ComponentFunctionMap mrb_func_map;
+  BytecodeCache mrb_bytecode_cache;
+  ScriptWatcher mrb_script_watcher;
+  Scheduler< Derived > mrb_scheduler;
+  VMPool mrb_vm_pool;
+  CommandBuffer mrb_commands;
+  GCPacer mrb_gc_pacer;
+  mrb_value mrb_registry_object = mrb_nil_value();
+  MRubyRegistryPtr* _mrb_main_binding = nullptr;
+#ifdef ENTT_MRUBY_PROFILE
+  Profiler mrb_profiler;
+#endif
   std::unordered_map< std::string, _mrb_component_type_info_t > mrb_dynamic_components;
-  static std::unordered_map< entt::id_type, entt::id_type > _mrb_entt_type_index_to_id;
+  // entt type hashes of the static components, indexed by entt::type_seq
+  std::vector< entt::id_type > _mrb_entt_type_index_to_id;
+  // Connects a static component's entt signal to ComponentEvents, by seq
+  using _mrb_event_connector_t = void(*)(entt::registry&, ComponentEvents&, EventKind);
+  std::vector< _mrb_event_connector_t > _mrb_event_connectors;
+  // Connects a static component's entt signals to ChangeTracker, by seq
+  using _mrb_change_connector_t = void(*)(entt::registry&, ChangeTracker&);
+  std::vector< _mrb_change_connector_t > _mrb_change_connectors;
+  std::vector< ComponentGroup > mrb_groups;
+  // Sorting of the static components by seq, and the rank buffer
+  // sort_like reuses
+  std::vector< ComponentSorter > _mrb_sorters;
+  SortRanks _mrb_sort_ranks;
+
+  // Find a component id by name, registering a new dynamic component for
+  // names that haven't been seen yet
+  mrb_int mrb_component_id(const std::string& name)
+  {
+    const auto iter = mrb_dynamic_components.find(name);
+    if(iter != mrb_dynamic_components.cend())
+      return iter->second.index;
+
+    mrb_int id = derived().next_dynamic_component_id++;
+    mrb_dynamic_components[ name ] = {
+      static_cast<entt::id_type>(id),
+      entt::type_id<DynamicComponents>().hash(),
+      true,
+      name
+    };
+    return id;
+  }
+
+  // Resolve a component given as an id, a String or a Symbol. Names are
+  // resolved once per symbol, after that it's a lookup in symbol_ids.
+  static mrb_int mrb_value_to_component_id(mrb_state* mrb, MRubyRegistryPtr* binding, mrb_value component)
+  {
+    if(mrb_fixnum_p(component))
+    {
+      const mrb_int id = mrb_fixnum(component);
+      if(binding->worker && id >= Derived::max_static_components)
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "dynamic components are not available in worker VMs");
+      return id;
+    }
+
+    mrb_sym sym;
+    if(mrb_symbol_p(component))
+      sym = mrb_symbol(component);
+    else if(mrb_string_p(component))
+      sym = mrb_intern_str(mrb, component);
+    else
+      mrb_raise(mrb, E_TYPE_ERROR, "component must be an Integer, String or Symbol");
+
+    auto& ids = binding->symbol_ids;
+    const auto iter = ids.find(sym);
+    if(iter != ids.cend())
+      return iter->second;
+    // Worker VMs know every static component up front and must not touch
+    // the shared name table while other threads run
+    if(binding->worker)
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "unknown component");
+
+    mrb_int size;
+    const char* name = mrb_sym2name_len(mrb, sym, &size);
+    const mrb_int id = binding->get()->mrb_component_id(std::string(name, name+size));
+    ids[ sym ] = id;
+    return id;
+  }
+
+  static void mrb_require_main_vm(mrb_state* mrb, MRubyRegistryPtr* binding)
+  {
+    if(binding && binding->worker)
+      mrb_raise(mrb, E_RUNTIME_ERROR, "not available in worker VMs");
+  }
+
+  static void mrb_require_main_vm(mrb_state* mrb, mrb_value self)
+  {
+    mrb_require_main_vm(mrb, mrb_value_to_binding(mrb, self));
+  }
+
+  // Worker VMs, and the main VM during a Ruby system running alongside
+  // others, may only write the components their system writes. Workers
+  // also never add components while other threads iterate the storages.
+  static void mrb_check_write(
+    mrb_state* mrb, MRubyRegistryPtr* binding, ComponentFunctionSet* fn,
+    mrb_int type, entt::entity entity)
+  {
+    if(! binding->writes.allows(type))
+      mrb_raise(mrb, E_RUNTIME_ERROR, "component is not writable by this system");
+    if(binding->worker && ! mrb_test(fn->has(mrb, *binding->get(), entity, type)))
+      mrb_raise(mrb, E_RUNTIME_ERROR, "worker VMs can't add components");
+  }
+
+  // Creating entities reallocates entt's entity list, which native systems
+  // may be reading on other threads
+  static void mrb_check_create(mrb_state* mrb, MRubyRegistryPtr* binding)
+  {
+    mrb_require_main_vm(mrb, binding);
+    if(binding->writes.enforced)
+      mrb_raise(mrb, E_RUNTIME_ERROR, "can't create entities in a system running alongside others");
+  }
+
+  ComponentFunctionSet* mrb_component_functions(mrb_int type)
+  {
+    return mrb_func_map.find(
+      (type >= Derived::max_static_components)
+        ? entt::type_seq< DynamicComponents >::value()
+        : static_cast< std::size_t >(type) );
+  }
 
-  // Create a new dynamic component, or return a component ID
+  // Create a new dynamic component, or return a component ID. Scripts can
+  // keep the id and pass it instead of the name.
   static mrb_value mrb_registry_new_component(
     mrb_state* mrb, mrb_value self)
   {
-    Derived* registry = mrb_value_to_registry(mrb, self);
-    if(!registry)
+    MRubyRegistryPtr* binding = mrb_value_to_binding(mrb, self);
+    if(!binding || !binding->get())
       return mrb_nil_value();
 
-    const char* name;
-    mrb_int size, id;
-    if(mrb_get_args(mrb, "s", &name, &size) < 1)
+    mrb_value component;
+    if(mrb_get_args(mrb, "o", &component) < 1)
       return mrb_nil_value();
 
-    std::string strname(name, name+size);
-
-    const auto iter = registry->mrb_dynamic_components.find(strname);
-    if(iter != registry->mrb_dynamic_components.cend())
-    {
-      id = iter->second.index;
-    }
-    else
-    {
-      id = registry->next_dynamic_component_id++;
-      registry->mrb_dynamic_components[ strname ] = {
-        static_cast<entt::id_type>(id),
-        entt::type_id<DynamicComponents>().hash(),
-        true,
-        strname
-      };
-    }
-    return mrb_fixnum_value(id);
+    return mrb_fixnum_value(mrb_value_to_component_id(mrb, binding, component));
   }
 
   // Return an array of component names
@@ -247,248 +334,2101 @@ struct RegistryMixin
     return mrb_ary_new_from_values(mrb, num_components, array);
   }
 
-  static mrb_value mrb_registry_entities(
-    mrb_state* mrb, mrb_value self)
+  static std::vector< mrb_int > mrb_registry_terms(
+    mrb_state* mrb, mrb_value self, const mrb_value* args, mrb_int size)
   {
-    Derived* registry = mrb_value_to_registry(mrb, self);
-    if(!registry)
-      return mrb_nil_value();
+    MRubyRegistryPtr* binding = mrb_value_to_binding(mrb, self);
+    std::vector< mrb_int > types(size);
+    for(mrb_int i = 0; i < size; ++i)
+      types[i] = mrb_value_to_component_id(mrb, binding, args[i]);
+    return types;
+  }
 
+  // Call fn(entity) for each entity that has all of the given components.
+  // Static components go through a runtime view, dynamic ones are checked
+  // against their own storage.
+  template< typename Fn >
+  void mrb_each_entity(const std::vector< mrb_int >& types, Fn&& fn)
+  {
     const auto& max_static_components = Derived::max_static_components;
+    auto& dyn = derived().template ctx< DynamicComponents >();
 
-    mrb_value block = mrb_nil_value();
-    mrb_value* args;
-    mrb_int size;
-    if(mrb_get_args(mrb, "*&", &args, &size, &block) == 0)
-    {
-      return mrb_nil_value();
-    }
+    std::vector< entt::id_type > components;
+    std::vector< DynamicPool* > dynamic;
 
-    RProc* proc = mrb_proc_ptr(block);
-    if(!proc)
+    for(const auto type : types)
     {
-      return mrb_nil_value();
+      if(type < max_static_components)
+      {
+        const auto index = static_cast< std::size_t >(type);
+        if(index >= _mrb_entt_type_index_to_id.size() || ! _mrb_entt_type_index_to_id[ index ])
+          return;
+        components.push_back(_mrb_entt_type_index_to_id[ index ]);
+      }
+      else
+      {
+        auto pool = dyn.pool(type);
+        if(!pool)
+          return;
+        dynamic.push_back(pool);
+      }
     }
 
-    std::vector< entt::id_type > components, dynamic;
-
-    for(int i = 0; i < size; ++i)
+    const auto has_dynamic = [&dynamic](const entt::entity entity)
     {
-      auto& arg = args[i];
-      if(mrb_fixnum_p(arg))
-      {
-        mrb_int type = mrb_fixnum(arg);
-        if(type < max_static_components)
+      return std::all_of(
+        dynamic.cbegin(), dynamic.cend(),
+        [entity](const auto pool)
         {
-          components.push_back(type);
+          return pool->contains(entity);
         }
-        else
-        {
-          if(dynamic.empty())
-          {
-            components.push_back(entt::type_seq< DynamicComponents >::value());
-          }
+      );
+    };
 
-          dynamic.push_back(type);
-        }
+    if(! components.empty())
+    {
+      auto view = derived().runtime_view(components.cbegin(), components.cend());
+      for(const auto entity : view)
+      {
+        if(has_dynamic(entity))
+          fn(entity);
       }
     }
-
-    for(auto& component : components)
-      component = _mrb_entt_type_index_to_id[component];
-
-    auto view = registry->runtime_view(components.cbegin(), components.cend());
-
-    if(dynamic.empty())
+    else if(! dynamic.empty())
     {
-      for(auto entity : view)
+      // Walk the smallest dynamic storage, back to front like entt does
+      auto smallest = *std::min_element(
+        dynamic.cbegin(), dynamic.cend(),
+        [](const auto lhs, const auto rhs)
+        {
+          return lhs->size() < rhs->size();
+        }
+      );
+      for(auto pos = smallest->size(); pos; --pos)
       {
-        const auto id = std::underlying_type_t< entt::entity >(entity);
-        mrb_yield(mrb, block, mrb_fixnum_value(id));
+        if(pos > smallest->size())
+          continue;
+        const auto entity = smallest->data()[ pos - 1 ];
+        if(derived().valid(entity) && has_dynamic(entity))
+          fn(entity);
       }
     }
     else
     {
-      for(const auto entity : view)
+      derived().each([&fn](const entt::entity entity)
       {
-        const auto id = std::underlying_type_t< entt::entity >(entity);
+        fn(entity);
+      });
+    }
+  }
 
-        const auto& others = registry->template get< DynamicComponents >(entity).components;
-        const auto match = std::all_of(
-          dynamic.cbegin(), dynamic.cend(),
-          [&others](const auto type)
-          {
-            return others.find(type) != others.cend();
-          }
-        );
-        if(match)
-          mrb_yield(mrb, block, mrb_fixnum_value(id));
-      }
+  // Run fn with structural changes deferred. The outermost iteration
+  // flushes them when it ends, also when the block raises or breaks.
+  template< typename Fn >
+  static void mrb_iterate(mrb_state* mrb, mrb_value self, Fn&& fn)
+  {
+    mrb_iterate(mrb, mrb_value_to_binding(mrb, self), std::forward< Fn >(fn));
+  }
+
+  template< typename Fn >
+  static void mrb_iterate(mrb_state* mrb, MRubyRegistryPtr* binding, Fn&& fn)
+  {
+    if(binding->worker)
+    {
+      // Worker VMs can't make structural changes to begin with
+      fn();
+      return;
     }
 
-    return self;
+    struct Context
+    {
+      Derived* registry;
+      Fn* fn;
+    };
+    Context context{ binding->get(), &fn };
+    ++context.registry->mrb_commands.depth;
+
+    mrb_ensure(mrb,
+      [](mrb_state* mrb, mrb_value data)
+      {
+        (*((Context*)mrb_cptr(data))->fn)();
+        return mrb_nil_value();
+      },
+      mrb_cptr_value(mrb, &context),
+      [](mrb_state* mrb, mrb_value data)
+      {
+        auto registry = ((Context*)mrb_cptr(data))->registry;
+        --registry->mrb_commands.depth;
+        registry->mrb_flush(mrb);
+        return mrb_nil_value();
+      },
+      mrb_cptr_value(mrb, &context));
   }
-  
 
-  static mrb_value mrb_registry_create(mrb_state* mrb, mrb_value self)
+  // Apply the structural changes recorded during iteration, then deliver
+  // the buffered component events, reporting callbacks that raise through
+  // mrb_on_exception. Returns the number of commands applied.
+  mrb_int mrb_flush(mrb_state* state)
   {
-    Derived* registry = mrb_value_to_registry(mrb, self);
-    if(!registry)
-      return mrb_nil_value();
-    auto entity = registry->create();
-    return mrb_fixnum_value(std::underlying_type_t< entt::entity >(entity));
+    if(mrb_commands.deferring())
+      return 0;
+    const mrb_int applied = mrb_apply_commands(state);
+    derived().template ctx< ComponentEvents >().dispatch([this, state](mrb_value error)
+    {
+      state->exc = mrb_obj_ptr(error);
+      derived().mrb_on_exception(state);
+      state->exc = nullptr;
+    });
+    return applied;
   }
 
+  mrb_int mrb_apply_commands(mrb_state* state)
+  {
+    if(mrb_commands.empty())
+      return 0;
 
-  using MrubyInvokeHandler = mrb_value(*)(mrb_state*, Derived*, ComponentFunctionSet&, mrb_int, mrb_int);
+    // Taken out first, so a command that raises doesn't leave the rest to
+    // be applied twice
+    mrb_commands.sort();
+    std::vector< Command > commands;
+    commands.swap(mrb_commands.commands);
 
-  static bool mrb_registry_unpack(
-    mrb_state* mrb, mrb_value self,
-    mrb_int& entity, mrb_int& type, mrb_value*& arg,
-    mrb_int& arg_count,
-    Derived*& registry,
-    ComponentFunctionSet*& fn)
+    const int arena = mrb_gc_arena_save(state);
+    for(const auto& command : commands)
+    {
+      const auto entity = command.entity;
+      auto fn = mrb_component_functions(command.type);
+      const mrb_value* argv = mrb_commands.argv(command);
+
+      switch(command.kind)
+      {
+        case Command::set:
+          if(fn && derived().valid(entity))
+            fn->set(state, derived(), entity, command.type, command.argc, const_cast< mrb_value* >(argv));
+          break;
+
+        case Command::set_many:
+        {
+          std::vector< mrb_value > ids;
+          if(fn && from_mrb(state, argv[0], ids))
+            mrb_apply_set_many(state, &derived(), fn, command.type, ids, argv[1]);
+          break;
+        }
+
+        case Command::remove:
+          if(fn && derived().valid(entity))
+            fn->remove(state, derived(), entity, command.type);
+          break;
+
+        case Command::destroy:
+          if(derived().valid(entity))
+            mrb_destroy(entity);
+          break;
+      }
+      mrb_gc_arena_restore(state, arena);
+    }
+
+    mrb_commands.clear();
+    return commands.size();
+  }
+
+  // Buffer kind events of a component for block, see ComponentEvents
+  void mrb_subscribe(mrb_int type, EventKind kind, mrb_value block)
   {
-    if(mrb_get_args(mrb, "ii*", &entity, &type, &arg, &arg_count) < 2)
-      return false;
+    auto& events = derived().template ctx< ComponentEvents >();
+    if(type < Derived::max_static_components)
+    {
+      const auto index = static_cast< std::size_t >(type);
+      if(type < 0 || index >= _mrb_event_connectors.size() || ! _mrb_event_connectors[ index ])
+        return;
+      if(events.mark_connected(type, kind))
+        _mrb_event_connectors[ index ](derived(), events, kind);
+    }
+    events.subscribe(type, kind, block);
+  }
 
-    registry = mrb_value_to_registry(mrb, self);
-    if(!registry)
-      return false;
+  // registry.on_construct(component) { |ids| }, likewise on_update and
+  // on_destroy. Blocks run at the next flush.
+  template< EventKind Kind >
+  static mrb_value mrb_registry_on(mrb_state* mrb, mrb_value self)
+  {
+    mrb_require_main_vm(mrb, self);
+    MRubyRegistryPtr* binding = mrb_value_to_binding(mrb, self);
+    if(!binding || !binding->get())
+      return mrb_nil_value();
 
-    auto& iface = registry->mrb_func_map;
-    const auto iter = iface.find(
-      (type >= Derived::max_static_components)
-        ? entt::type_seq< DynamicComponents >::value()
-        : type );
-    if(iter == iface.cend())
-      return false;
+    mrb_value component, block = mrb_nil_value();
+    mrb_get_args(mrb, "o&", &component, &block);
+    if(mrb_nil_p(block))
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
 
-    fn = &iter->second;
-    return true;
+    const auto type = mrb_value_to_component_id(mrb, binding, component);
+    if(! binding->get()->mrb_component_functions(type))
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "unknown component");
+    binding->get()->mrb_subscribe(type, Kind, block);
+    return self;
   }
 
-  static mrb_value mrb_registry_valid(
-    mrb_state* mrb, mrb_value self)
+  static mrb_value mrb_registry_flush(mrb_state* mrb, mrb_value self)
   {
+    mrb_require_main_vm(mrb, self);
     Derived* registry = mrb_value_to_registry(mrb, self);
     if(!registry)
       return mrb_nil_value();
+    return mrb_fixnum_value(registry->mrb_flush(mrb));
+  }
 
-    mrb_int entity;
-    if(mrb_get_args(mrb, "i", &entity) != 1)
-      return mrb_nil_value();
+  // Start recording the ticks a component changes at, see ChangeTracker
+  void mrb_track_changes(mrb_int type)
+  {
+    auto& changes = derived().template ctx< ChangeTracker >();
+    if(! changes.track(type) || type >= Derived::max_static_components)
+      return;
+    const auto index = static_cast< std::size_t >(type);
+    if(type >= 0 && index < _mrb_change_connectors.size() && _mrb_change_connectors[ index ])
+      _mrb_change_connectors[ index ](derived(), changes);
+  }
 
-    return registry->valid(entt::entity(entity))
-      ? mrb_true_value()
-      : mrb_false_value();
+  // Entities whose component changed after tick, in the order of their
+  // latest change. Destroyed entities are left out.
+  std::vector< entt::entity > mrb_changed_since(mrb_int type, std::uint64_t tick)
+  {
+    auto& changes = derived().template ctx< ChangeTracker >();
+    std::vector< entt::entity > entities;
+    std::lock_guard< std::mutex > lock(changes.mutex);
+    if(auto log = changes.log(type))
+      log->each_since(tick, [&](entt::entity entity)
+      {
+        if(derived().valid(entity))
+          entities.push_back(entity);
+      });
+    return entities;
   }
 
-  static mrb_value mrb_registry_has(
-    mrb_state* mrb, mrb_value self)
+  static mrb_value mrb_registry_track_changes(mrb_state* mrb, mrb_value self)
   {
-    mrb_int entity, type;
-    mrb_value* arg;
-    mrb_int arg_count;
-    Derived* ptr;
-    ComponentFunctionSet* fn;
-    if(mrb_registry_unpack(mrb, self, entity, type, arg, arg_count, ptr, fn))
-      return fn->has(mrb, *ptr, (entt::entity)entity, type);
-    return mrb_nil_value();
+    mrb_require_main_vm(mrb, self);
+    MRubyRegistryPtr* binding = mrb_value_to_binding(mrb, self);
+    if(!binding || !binding->get())
+      return mrb_nil_value();
+
+    mrb_value component;
+    mrb_get_args(mrb, "o", &component);
+    const auto type = mrb_value_to_component_id(mrb, binding, component);
+    if(! binding->get()->mrb_component_functions(type))
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "unknown component");
+    binding->get()->mrb_track_changes(type);
+    return self;
   }
 
-  static mrb_value mrb_registry_get(
-    mrb_state* mrb, mrb_value self)
+  static mrb_value mrb_registry_tick(mrb_state* mrb, mrb_value self)
   {
-    mrb_int entity, type;
-    mrb_value* arg;
-    mrb_int arg_count;
-    Derived* ptr;
-    ComponentFunctionSet* fn;
-    if(mrb_registry_unpack(mrb, self, entity, type, arg, arg_count, ptr, fn))
-      return fn->get(mrb, *ptr, (entt::entity)entity, type);
-    return mrb_nil_value();
+    Derived* registry = mrb_value_to_registry(mrb, self);
+    if(!registry)
+      return mrb_nil_value();
+    return mrb_fixnum_value(registry->template ctx< ChangeTracker >().tick);
   }
 
-  static mrb_value mrb_registry_set(
-    mrb_state* mrb, mrb_value self)
+  static mrb_value mrb_registry_advance_tick(mrb_state* mrb, mrb_value self)
   {
-    mrb_int entity, type;
-    mrb_value* arg;
-    mrb_int arg_count;
-    Derived* ptr;
-    ComponentFunctionSet* fn;
-    if(mrb_registry_unpack(mrb, self, entity, type, arg, arg_count, ptr, fn))
-      return fn->set(mrb, *ptr, (entt::entity)entity, type, arg_count, arg);
-    return mrb_nil_value();
+    mrb_require_main_vm(mrb, self);
+    Derived* registry = mrb_value_to_registry(mrb, self);
+    if(!registry)
+      return mrb_nil_value();
+    return mrb_fixnum_value(registry->template ctx< ChangeTracker >().advance());
   }
 
-  static mrb_value mrb_registry_remove(
+  // entities_changed_since(tick, component) { |id| }, or an Array of ids
+  // without a block
+  static mrb_value mrb_registry_entities_changed_since(
     mrb_state* mrb, mrb_value self)
   {
-    mrb_int entity, type;
-    mrb_value* arg;
-    mrb_int arg_count;
-    Derived* ptr;
-    ComponentFunctionSet* fn;
-    if(mrb_registry_unpack(mrb, self, entity, type, arg, arg_count, ptr, fn))
-      return fn->remove(mrb, *ptr, (entt::entity)entity, type);
-    return mrb_nil_value();
-  }
+    MRubyRegistryPtr* binding = mrb_value_to_binding(mrb, self);
+    if(!binding || !binding->get())
+      return mrb_nil_value();
 
+    mrb_int tick;
+    mrb_value component, block = mrb_nil_value();
+    mrb_get_args(mrb, "io&", &tick, &component, &block);
+    if(tick < 0)
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "negative tick");
 
-  using MRubyRegistryPtr = MRuby::WeakPointer< Derived >;
+    Derived* registry = binding->get();
+    const auto type = mrb_value_to_component_id(mrb, binding, component);
+    if(! registry->template ctx< ChangeTracker >().tracked(type))
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "changes of this component are not tracked");
 
-  template< typename Component >
-  void mrb_init_component_name(mrb_state* state, RClass* ns)
-  {
-    std::string name = cpp_type_name_to_mrb(::MRuby::type_name< Component >());
-    auto id = entt::type_seq<Component>::value();
-    mrb_define_const(state, ns, name.c_str(), mrb_fixnum_value(id));
-    derived().mrb_dynamic_components[ name ] = _mrb_component_type_info<Component>();
+    const auto entities = registry->mrb_changed_since(type, static_cast< std::uint64_t >(tick));
+    if(mrb_nil_p(block))
+    {
+      mrb_value ids = mrb_ary_new_capa(mrb, entities.size());
+      for(const auto entity : entities)
+        mrb_ary_push(mrb, ids, mrb_fixnum_value(std::underlying_type_t< entt::entity >(entity)));
+      return ids;
+    }
+
+    const int arena = mrb_gc_arena_save(mrb);
+    for(const auto entity : entities)
+    {
+      mrb_yield(mrb, block, mrb_fixnum_value(std::underlying_type_t< entt::entity >(entity)));
+      mrb_gc_arena_restore(mrb, arena);
+    }
+    return self;
   }
 
-  template< typename... Components >
-  void mrb_init(mrb_state* state)
+  static mrb_value mrb_registry_entities(
+    mrb_state* mrb, mrb_value self)
   {
-    std::cout << "mrb_init< sizeof=" << sizeof...(Components) << std::endl ;
-    mrb_init_function_map<MRuby::ComponentInterface, MRuby::DynamicComponents, Components...>(
-      derived().mrb_func_map, derived());
-
-    // Set up an interface to access the registry from ruby
-    auto registry_class = MRuby::Class::bind< MRubyRegistryPtr >(
-      state, "Registry", state->object_class);
+    Derived* registry = mrb_value_to_registry(mrb, self);
+    if(!registry)
+      return mrb_nil_value();
 
-    registry_class
-      .define_method("create", Derived::mrb_registry_create, MRB_ARGS_REQ(0))
+    mrb_value block = mrb_nil_value();
+    mrb_value* args;
+    mrb_int size;
+    if(mrb_get_args(mrb, "*&", &args, &size, &block) == 0)
+    {
+      return mrb_nil_value();
+    }
+
+    if(mrb_nil_p(block))
+    {
+      return mrb_nil_value();
+    }
+
+    const auto types = mrb_registry_terms(mrb, self, args, size);
+    ENTT_MRUBY_PROFILE_SCOPE(registry, entities, types.empty() ? -1 : types[0]);
+
+    mrb_iterate(mrb, self, [&]
+    {
+      registry->mrb_each_entity(types, [&](const entt::entity entity)
+      {
+        ENTT_MRUBY_PROFILE_YIELD();
+        const auto id = std::underlying_type_t< entt::entity >(entity);
+        mrb_yield(mrb, block, mrb_fixnum_value(id));
+      });
+    });
+
+    return self;
+  }
+
+  // Yield the entity id followed by the value of each requested component,
+  // so a system needs one block call per entity
+  static mrb_value mrb_registry_each_with(
+    mrb_state* mrb, mrb_value self)
+  {
+    Derived* registry = mrb_value_to_registry(mrb, self);
+    if(!registry)
+      return mrb_nil_value();
+
+    mrb_value block = mrb_nil_value();
+    mrb_value* args;
+    mrb_int size;
+    mrb_get_args(mrb, "*&", &args, &size, &block);
+    if(mrb_nil_p(block))
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
+
+    const auto types = mrb_registry_terms(mrb, self, args, size);
+
+    std::vector< ComponentFunctionSet* > functions(size);
+    for(mrb_int i = 0; i < size; ++i)
+    {
+      functions[i] = registry->mrb_component_functions(types[i]);
+      if(! functions[i])
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "unknown component");
+    }
+
+    std::vector< mrb_value > argv(size + 1);
+
+    mrb_iterate(mrb, self, [&]
+    {
+      registry->mrb_each_entity(types, [&](const entt::entity entity)
+      {
+        const int arena = mrb_gc_arena_save(mrb);
+
+        argv[0] = mrb_fixnum_value(std::underlying_type_t< entt::entity >(entity));
+        for(mrb_int i = 0; i < size; ++i)
+          argv[i + 1] = functions[i]->get(mrb, *registry, entity, types[i]);
+        mrb_yield_argv(mrb, block, size + 1, argv.data());
+
+        mrb_gc_arena_restore(mrb, arena);
+      });
+    });
+
+    return self;
+  }
+
+  // Resolve the component and entity id array shared by get_many/set_many
+  static ComponentFunctionSet* mrb_registry_unpack_many(
+    mrb_state* mrb, mrb_value self, mrb_value component, mrb_value ids_value,
+    std::vector< mrb_value >& ids, mrb_int& type, Derived*& registry)
+  {
+    MRubyRegistryPtr* binding = mrb_value_to_binding(mrb, self);
+    if(!binding || !binding->get())
+      return nullptr;
+    registry = binding->get();
+
+    type = mrb_value_to_component_id(mrb, binding, component);
+    auto fn = registry->mrb_component_functions(type);
+    if(!fn)
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "unknown component");
+
+    if(! from_mrb(mrb, ids_value, ids))
+      mrb_raise(mrb, E_TYPE_ERROR, "entity ids must be an Array");
+    for(const auto id : ids)
+      if(! mrb_fixnum_p(id))
+        mrb_raise(mrb, E_TYPE_ERROR, "entity ids must be Integers");
+    return fn;
+  }
+
+  // registry.get_many(component, ids). Reflected components come back as
+  // { field: [value, ...] }, others as an Array with one value per id.
+  static mrb_value mrb_registry_get_many(
+    mrb_state* mrb, mrb_value self)
+  {
+    mrb_value component, ids_value;
+    mrb_get_args(mrb, "oo", &component, &ids_value);
+
+    std::vector< mrb_value > ids;
+    mrb_int type;
+    Derived* registry;
+    auto fn = mrb_registry_unpack_many(mrb, self, component, ids_value, ids, type, registry);
+    if(!fn)
+      return mrb_nil_value();
+
+    if(fn->get_many)
+      return fn->get_many(mrb, *registry, type, ids);
+
+    mrb_value result = mrb_ary_new_capa(mrb, ids.size());
+    const int arena = mrb_gc_arena_save(mrb);
+    for(const auto id : ids)
+    {
+      const auto entity = entt::entity(mrb_fixnum(id));
+      mrb_ary_push(mrb, result, registry->valid(entity)
+        ? fn->get(mrb, *registry, entity, type)
+        : mrb_nil_value());
+      mrb_gc_arena_restore(mrb, arena);
+    }
+    return result;
+  }
+
+  // registry.set_many(component, ids, values). values is either the Hash
+  // of columns get_many returns, or an Array with one value per id. Returns
+  // the number of entities set.
+  static mrb_value mrb_registry_set_many(
+    mrb_state* mrb, mrb_value self)
+  {
+    mrb_value component, ids_value, values;
+    mrb_get_args(mrb, "ooo", &component, &ids_value, &values);
+
+    std::vector< mrb_value > ids;
+    mrb_int type;
+    Derived* registry;
+    auto fn = mrb_registry_unpack_many(mrb, self, component, ids_value, ids, type, registry);
+    if(!fn)
+      return mrb_nil_value();
+
+    MRubyRegistryPtr* binding = mrb_value_to_binding(mrb, self);
+    if(binding->writes.enforced)
+      for(const auto id : ids)
+        mrb_check_write(mrb, binding, fn, type, entt::entity(mrb_fixnum(id)));
+
+    if(! (mrb_hash_p(values) && fn->set_many)
+      && (! mrb_array_p(values) || RARRAY_LEN(values) < static_cast< mrb_int >(ids.size())))
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "values must have one entry per entity");
+
+    // Adding components during iteration defers the whole call
+    if(! binding->worker && registry->mrb_commands.deferring())
+      for(const auto id : ids)
+        if(! mrb_test(fn->has(mrb, *registry, entt::entity(mrb_fixnum(id)), type)))
+        {
+          const mrb_value args[] = { ids_value, values };
+          registry->mrb_commands.record(Command::set_many, type, entt::null, 2, args);
+          return mrb_fixnum_value(0);
+        }
+
+    return mrb_apply_set_many(mrb, registry, fn, type, ids, values);
+  }
+
+  static mrb_value mrb_apply_set_many(
+    mrb_state* mrb, Derived* registry, ComponentFunctionSet* fn, mrb_int type,
+    const std::vector< mrb_value >& ids, mrb_value values)
+  {
+    if(mrb_hash_p(values) && fn->set_many)
+      return fn->set_many(mrb, *registry, type, ids, values);
+
+    mrb_int updated = 0;
+    const int arena = mrb_gc_arena_save(mrb);
+    for(std::size_t i = 0; i < ids.size(); ++i)
+    {
+      const auto entity = entt::entity(mrb_fixnum(ids[i]));
+      if(! registry->valid(entity))
+        continue;
+      mrb_value value = RARRAY_PTR(values)[i];
+      fn->set(mrb, *registry, entity, type, 1, &value);
+      mrb_gc_arena_restore(mrb, arena);
+      ++updated;
+    }
+    return mrb_fixnum_value(updated);
+  }
+
+  // registry.column(component, field) returns a FloatColumn or DoubleColumn
+  // over that field of every instance of a reflected component
+  static mrb_value mrb_registry_column(
+    mrb_state* mrb, mrb_value self)
+  {
+    mrb_require_main_vm(mrb, self);
+    mrb_value component;
+    mrb_sym field;
+    mrb_get_args(mrb, "on", &component, &field);
+
+    MRubyRegistryPtr* binding = mrb_value_to_binding(mrb, self);
+    if(!binding || !binding->get())
+      return mrb_nil_value();
+
+    const auto type = mrb_value_to_component_id(mrb, binding, component);
+    auto fn = binding->get()->mrb_component_functions(type);
+    if(!fn || !fn->column)
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "component has no columns");
+    return fn->column(mrb, *binding->get(), type, field);
+  }
+
+  template< typename... Components >
+  static std::vector< mrb_int > mrb_components()
+  {
+    return { mrb_int(entt::type_seq< Components >::value())... };
+  }
+
+  // Create the entt group owning Owned and observing Observed, for scripts
+  // to iterate through registry.group(owned: [...], observed: [...]).
+  // entt's rules apply: a component is owned by one group at most and a
+  // group holds two components or more.
+  template< typename... Owned, typename... Observed >
+  void mrb_define_group(entt::get_t< Observed... > = {})
+  {
+    using Access = GroupAccess< entt::type_list< Owned... >, entt::type_list< Observed... > >;
+    static_assert(Access::component_count <= ComponentGroupData::max_components, "too many components for a group");
+    Access::group(derived());
+    mrb_groups.push_back({
+      mrb_components< Owned... >(), mrb_components< Observed... >(),
+      &Access::each, &Access::size
+    });
+  }
+
+  // registry.group(owned: [...], observed: [...]) returns the Group
+  // declared with those components. Its each yields the components in
+  // the order given here.
+  static mrb_value mrb_registry_group(mrb_state* mrb, mrb_value self)
+  {
+    mrb_require_main_vm(mrb, self);
+    MRubyRegistryPtr* binding = mrb_value_to_binding(mrb, self);
+    if(!binding || !binding->get())
+      return mrb_nil_value();
+
+    mrb_value options = mrb_nil_value();
+    mrb_get_args(mrb, "|H", &options);
+    std::vector< mrb_int > owned, observed;
+    if(! mrb_nil_p(options))
+    {
+      owned = mrb_registry_term_array(mrb, self,
+        mrb_hash_get(mrb, options, mrb_symbol_value(mrb_intern_lit(mrb, "owned"))));
+      observed = mrb_registry_term_array(mrb, self,
+        mrb_hash_get(mrb, options, mrb_symbol_value(mrb_intern_lit(mrb, "observed"))));
+    }
+
+    const auto same_set = [](std::vector< mrb_int > lhs, std::vector< mrb_int > rhs)
+    {
+      std::sort(lhs.begin(), lhs.end());
+      std::sort(rhs.begin(), rhs.end());
+      return lhs == rhs;
+    };
+    for(const auto& group : binding->get()->mrb_groups)
+    {
+      if(! same_set(group.owned, owned) || ! same_set(group.observed, observed))
+        continue;
+
+      // Where each declared component goes in the order asked for
+      std::vector< mrb_int > requested(owned);
+      requested.insert(requested.end(), observed.cbegin(), observed.cend());
+      std::vector< mrb_int > declared(group.owned);
+      declared.insert(declared.end(), group.observed.cbegin(), group.observed.cend());
+
+      RData* object = Data_Wrap_Struct(mrb, mrb_class_get(mrb, "Group"), &GroupBinder< ComponentGroupData >::mrb_type, nullptr);
+      auto data = (ComponentGroupData*)mrb_malloc(mrb, sizeof(ComponentGroupData));
+      data->binding = binding;
+      data->each = group.each;
+      data->size = group.size;
+      data->count = declared.size();
+      for(std::size_t k = 0; k < declared.size(); ++k)
+        data->slots[k] = std::find(requested.cbegin(), requested.cend(), declared[k]) - requested.cbegin();
+      object->data = data;
+      return mrb_obj_value(object);
+    }
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "no group was defined with these components");
+  }
+
+  static ComponentGroupData& mrb_group_data(mrb_state* mrb, mrb_value self)
+  {
+    return *DATA_GET_PTR(mrb, self, &GroupBinder< ComponentGroupData >::mrb_type, ComponentGroupData);
+  }
+
+  // group.each { |id, *components| }
+  static mrb_value mrb_group_each(mrb_state* mrb, mrb_value self)
+  {
+    mrb_value block = mrb_nil_value();
+    mrb_get_args(mrb, "&", &block);
+    if(mrb_nil_p(block))
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
+
+    auto& group = mrb_group_data(mrb, self);
+    auto binding = static_cast< MRubyRegistryPtr* >(group.binding);
+    if(!binding->get())
+      return mrb_nil_value();
+
+    mrb_iterate(mrb, binding, [&]
+    {
+      group.each(mrb, *binding->get(), block, group.argv, group.slots);
+    });
+    return self;
+  }
+
+  static mrb_value mrb_group_size(mrb_state* mrb, mrb_value self)
+  {
+    auto& group = mrb_group_data(mrb, self);
+    auto binding = static_cast< MRubyRegistryPtr* >(group.binding);
+    if(!binding->get())
+      return mrb_nil_value();
+    return mrb_fixnum_value(group.size(*binding->get()));
+  }
+
+  // registry.query(with: [...], without: [...], optional: [...]) compiles
+  // the terms into a Query. Its each yields the id, the with components
+  // and the optional ones, nil where an entity lacks them.
+  static mrb_value mrb_registry_query(mrb_state* mrb, mrb_value self)
+  {
+    MRubyRegistryPtr* binding = mrb_value_to_binding(mrb, self);
+    if(!binding || !binding->get())
+      return mrb_nil_value();
+    Derived* registry = binding->get();
+
+    mrb_value options = mrb_nil_value();
+    mrb_get_args(mrb, "|H", &options);
+    const auto terms = [&](const char* name)
+    {
+      if(mrb_nil_p(options))
+        return std::vector< mrb_int >();
+      return mrb_registry_term_array(mrb, self,
+        mrb_hash_get(mrb, options, mrb_symbol_value(mrb_intern_cstr(mrb, name))));
+    };
+    const auto with = terms("with");
+    const auto without = terms("without");
+    const auto optional = terms("optional");
+    if(with.empty())
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "a query needs at least one with term");
+    if(with.size() + optional.size() > ComponentQuery::max_terms)
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "too many query terms");
+
+    std::vector< mrb_int > types(with);
+    types.insert(types.end(), optional.cbegin(), optional.cend());
+    std::vector< ComponentFunctionSet* > functions(types.size());
+    for(std::size_t i = 0; i < types.size(); ++i)
+    {
+      functions[i] = registry->mrb_component_functions(types[i]);
+      if(! functions[i])
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "unknown component");
+    }
+
+    // Nothing below raises, the query can't leak
+    RData* object = Data_Wrap_Struct(mrb, mrb_class_get(mrb, "Query"), &QueryBinder< ComponentQuery >::mrb_type, nullptr);
+    auto query = new(mrb_malloc(mrb, sizeof(ComponentQuery))) ComponentQuery();
+    object->data = query;
+
+    query->binding = binding;
+    query->types = std::move(types);
+    query->functions = std::move(functions);
+    query->required = with.size();
+    query->pools.resize(query->types.size(), nullptr);
+    query->argv.resize(1 + query->types.size());
+
+    const auto& static_ids = registry->_mrb_entt_type_index_to_id;
+    const auto static_id = [&static_ids](mrb_int type) -> entt::id_type
+    {
+      const auto index = static_cast< std::size_t >(type);
+      return (type >= 0 && index < static_ids.size()) ? static_ids[ index ] : 0;
+    };
+
+    std::vector< entt::id_type > include, exclude;
+    for(std::size_t i = 0; i < query->types.size(); ++i)
+    {
+      const auto type = query->types[i];
+      if(type >= Derived::max_static_components)
+        query->dynamic_mask |= std::uint64_t(1) << i;
+      else if(i < query->required)
+      {
+        if(const auto id = static_id(type))
+          include.push_back(id);
+        else
+          query->empty = true;
+      }
+    }
+    // Static exclusions go to the view, unless every with term is dynamic
+    // and there is none
+    for(const auto type : without)
+    {
+      if(type >= Derived::max_static_components)
+        query->without.push_back(type);
+      else if(const auto id = static_id(type))
+      {
+        exclude.push_back(id);
+        if(include.empty())
+          query->without.push_back(type);
+      }
+    }
+    query->without_pools.resize(query->without.size(), nullptr);
+    if(! include.empty())
+      query->view = registry->runtime_view(include.cbegin(), include.cend(), exclude.cbegin(), exclude.cend());
+
+    return mrb_obj_value(object);
+  }
+
+  static ComponentQuery& mrb_query_data(mrb_state* mrb, mrb_value self)
+  {
+    return *DATA_GET_PTR(mrb, self, &QueryBinder< ComponentQuery >::mrb_type, ComponentQuery);
+  }
+
+  // Call fn(entity) for each entity matching query
+  template< typename Fn >
+  void mrb_each_query(mrb_state* state, ComponentQuery& query, Fn&& fn)
+  {
+    auto& dyn = derived().template ctx< DynamicComponents >();
+    for(std::size_t i = 0; i < query.types.size(); ++i)
+      if(query.dynamic(i) && ! query.pools[i])
+        query.pools[i] = dyn.pool(query.types[i]);
+    for(std::size_t i = 0; i < query.without.size(); ++i)
+      if(query.without[i] >= Derived::max_static_components && ! query.without_pools[i])
+        query.without_pools[i] = dyn.pool(query.without[i]);
+    if(query.empty)
+      return;
+
+    DynamicPool* smallest = nullptr;
+    for(std::size_t i = 0; i < query.required; ++i)
+      if(query.dynamic(i))
+      {
+        if(! query.pools[i])
+          return;
+        if(! smallest || query.pools[i]->size() < smallest->size())
+          smallest = query.pools[i];
+      }
+
+    const auto matches = [&](const entt::entity entity)
+    {
+      for(std::size_t i = 0; i < query.required; ++i)
+        if(query.dynamic(i) && ! query.pools[i]->contains(entity))
+          return false;
+      for(std::size_t i = 0; i < query.without.size(); ++i)
+      {
+        const auto type = query.without[i];
+        if(type < Derived::max_static_components)
+        {
+          if(mrb_test(mrb_component_functions(type)->has(state, derived(), entity, type)))
+            return false;
+        }
+        else if(query.without_pools[i] && query.without_pools[i]->contains(entity))
+          return false;
+      }
+      return true;
+    };
+
+    if(query.view)
+    {
+      for(const auto entity : *query.view)
+        if(matches(entity))
+          fn(entity);
+      return;
+    }
+
+    // Walk the smallest dynamic storage, back to front like entt does
+    for(auto pos = smallest->size(); pos; --pos)
+    {
+      if(pos > smallest->size())
+        continue;
+      const auto entity = smallest->data()[ pos - 1 ];
+      if(derived().valid(entity) && matches(entity))
+        fn(entity);
+    }
+  }
+
+  // query.each { |id, *components| }
+  static mrb_value mrb_query_each(mrb_state* mrb, mrb_value self)
+  {
+    mrb_value block = mrb_nil_value();
+    mrb_get_args(mrb, "&", &block);
+    if(mrb_nil_p(block))
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
+
+    auto& query = mrb_query_data(mrb, self);
+    auto binding = static_cast< MRubyRegistryPtr* >(query.binding);
+    Derived* registry = binding->get();
+    if(!registry)
+      return mrb_nil_value();
+    ENTT_MRUBY_PROFILE_SCOPE(registry, entities, query.types[0]);
+
+    mrb_value* argv = query.argv.data();
+    const auto count = static_cast< mrb_int >(query.argv.size());
+    mrb_iterate(mrb, binding, [&]
+    {
+      const int arena = mrb_gc_arena_save(mrb);
+      registry->mrb_each_query(mrb, query, [&](const entt::entity entity)
+      {
+        ENTT_MRUBY_PROFILE_YIELD();
+        argv[0] = mrb_fixnum_value(entt::to_integral(entity));
+        for(std::size_t i = 0; i < query.types.size(); ++i)
+        {
+          if(! query.dynamic(i))
+          {
+            // get yields false for a missing component, queries yield nil
+            auto fn = query.functions[i];
+            argv[i + 1] = i < query.required || mrb_test(fn->has(mrb, *registry, entity, query.types[i]))
+              ? fn->get(mrb, *registry, entity, query.types[i])
+              : mrb_nil_value();
+          }
+          else if(query.pools[i] && query.pools[i]->contains(entity))
+            argv[i + 1] = query.pools[i]->get(entity);
+          else
+            argv[i + 1] = mrb_nil_value();
+        }
+        mrb_yield_argv(mrb, block, count, argv);
+        mrb_gc_arena_restore(mrb, arena);
+      });
+    });
+    return self;
+  }
+
+  // Number of entities matching, found by walking them
+  static mrb_value mrb_query_count(mrb_state* mrb, mrb_value self)
+  {
+    auto& query = mrb_query_data(mrb, self);
+    Derived* registry = static_cast< MRubyRegistryPtr* >(query.binding)->get();
+    if(!registry)
+      return mrb_nil_value();
+    mrb_int count = 0;
+    registry->mrb_each_query(mrb, query, [&count](const entt::entity)
+    {
+      ++count;
+    });
+    return mrb_fixnum_value(count);
+  }
+
+  // Sorting reorders a storage, which entt forbids for components a group
+  // owns and which would break iterations and systems in progress
+  static void mrb_check_sortable(mrb_state* mrb, MRubyRegistryPtr* binding, mrb_int type)
+  {
+    mrb_require_main_vm(mrb, binding);
+    Derived* registry = binding->get();
+    if(registry->mrb_commands.deferring() || registry->mrb_scheduler.running)
+      mrb_raise(mrb, E_RUNTIME_ERROR, "can't sort while iterating");
+    const auto index = static_cast< std::size_t >(type);
+    if(type < 0 || type >= Derived::max_static_components
+      || index >= registry->_mrb_sorters.size() || ! registry->_mrb_sorters[ index ].like)
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "only static components can be sorted");
+    for(const auto& group : registry->mrb_groups)
+      if(std::find(group.owned.cbegin(), group.owned.cend(), type) != group.owned.cend())
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "component is owned by a group");
+  }
+
+  static mrb_value mrb_registry_option(mrb_state* mrb, mrb_value options, const char* name)
+  {
+    if(mrb_nil_p(options))
+      return mrb_nil_value();
+    return mrb_hash_get(mrb, options, mrb_symbol_value(mrb_intern_cstr(mrb, name)));
+  }
+
+  // registry.sort(component, by: field, descending: false, incremental: false)
+  // orders a reflected component's storage by one of its fields, see
+  // sort_storage for incremental
+  static mrb_value mrb_registry_sort(mrb_state* mrb, mrb_value self)
+  {
+    MRubyRegistryPtr* binding = mrb_value_to_binding(mrb, self);
+    if(!binding || !binding->get())
+      return mrb_nil_value();
+
+    mrb_value component, options = mrb_nil_value();
+    mrb_get_args(mrb, "o|H", &component, &options);
+    const auto type = mrb_value_to_component_id(mrb, binding, component);
+    mrb_check_sortable(mrb, binding, type);
+
+    const mrb_value by = mrb_registry_option(mrb, options, "by");
+    mrb_sym field;
+    if(mrb_symbol_p(by))
+      field = mrb_symbol(by);
+    else if(mrb_string_p(by))
+      field = mrb_intern_str(mrb, by);
+    else
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "sort needs by: field");
+
+    auto fn = binding->get()->mrb_component_functions(type);
+    if(!fn || !fn->sort)
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "component has no reflected fields");
+    fn->sort(mrb, *binding->get(), type, field,
+      mrb_test(mrb_registry_option(mrb, options, "descending")),
+      mrb_test(mrb_registry_option(mrb, options, "incremental")));
+    return self;
+  }
+
+  // registry.sort_like(component, other, incremental: false) orders a
+  // storage so the entities it shares with other's come in other's order
+  static mrb_value mrb_registry_sort_like(mrb_state* mrb, mrb_value self)
+  {
+    MRubyRegistryPtr* binding = mrb_value_to_binding(mrb, self);
+    if(!binding || !binding->get())
+      return mrb_nil_value();
+    Derived* registry = binding->get();
+
+    mrb_value component, other_component, options = mrb_nil_value();
+    mrb_get_args(mrb, "oo|H", &component, &other_component, &options);
+    const auto type = mrb_value_to_component_id(mrb, binding, component);
+    const auto other = mrb_value_to_component_id(mrb, binding, other_component);
+    mrb_check_sortable(mrb, binding, type);
+
+    auto& ranks = registry->_mrb_sort_ranks;
+    if(other >= Derived::max_static_components)
+    {
+      auto pool = registry->template ctx< DynamicComponents >().pool(other);
+      ranks.build(pool ? pool->data() : nullptr, pool ? pool->size() : 0);
+    }
+    else
+    {
+      const auto index = static_cast< std::size_t >(other);
+      if(other < 0 || index >= registry->_mrb_sorters.size() || ! registry->_mrb_sorters[ index ].ranks)
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "unknown component");
+      registry->_mrb_sorters[ index ].ranks(*registry, ranks);
+    }
+    registry->_mrb_sorters[ type ].like(*registry, ranks,
+      mrb_test(mrb_registry_option(mrb, options, "incremental")));
+    return self;
+  }
+
+  // Register a native system by the component ids it reads and writes,
+  // replacing any system of the same name. With no components declared it
+  // runs alone. Must not be called while systems are running.
+  void mrb_add_system(
+    const std::string& name,
+    std::vector< mrb_int > reads, std::vector< mrb_int > writes,
+    typename System< Derived >::Native fn)
+  {
+    const bool exclusive = reads.empty() && writes.empty();
+    auto& system = mrb_scheduler.add(name, std::move(reads), std::move(writes), exclusive);
+    system.native = std::move(fn);
+    for(const auto type : system.reads)
+      system.on_vm |= type >= Derived::max_static_components;
+    for(const auto type : system.writes)
+      system.on_vm |= type >= Derived::max_static_components;
+  }
+
+  // Run every system once, flush and advance the change tick. Ruby
+  // exceptions are reported through mrb_on_exception, native ones are
+  // rethrown. Either way what the other systems deferred is flushed first.
+  void mrb_run_systems(mrb_state* state, double dt)
+  {
+    mrb_value error = mrb_nil_value();
+    std::exception_ptr native_error;
+    // Structural changes wait for every system, workers included, to finish
+    ++mrb_commands.depth;
+    try
+    {
+      error = mrb_scheduler.run(derived(), mrb_registry_object, dt);
+    }
+    catch(...)
+    {
+      native_error = std::current_exception();
+    }
+    --mrb_commands.depth;
+    derived().template ctx< ChangeTracker >().advance();
+    mrb_flush(state);
+
+    if(native_error)
+      std::rethrow_exception(native_error);
+    if(! mrb_nil_p(error))
+    {
+      state->exc = mrb_obj_ptr(error);
+      derived().mrb_on_exception(state);
+      state->exc = nullptr;
+    }
+  }
+
+  // Hold the main VM to writes, component ids, while a Ruby system runs
+  // alongside others. nullptr lifts the confinement.
+  void mrb_confine_writes(const std::vector< mrb_int >* writes)
+  {
+    _mrb_main_binding->writes.confine(writes);
+  }
+
+  const SystemTiming* mrb_system_timing(const std::string& name) const
+  {
+    return mrb_scheduler.timing(name);
+  }
+
+  static std::vector< mrb_int > mrb_registry_term_array(
+    mrb_state* mrb, mrb_value self, mrb_value terms)
+  {
+    if(mrb_nil_p(terms))
+      return {};
+    std::vector< mrb_value > values;
+    if(! from_mrb(mrb, terms, values))
+      mrb_raise(mrb, E_TYPE_ERROR, "component sets must be Arrays");
+    return mrb_registry_terms(mrb, self, values.data(), values.size());
+  }
+
+  // add_system(name, reads, writes) { |registry, dt| }
+  static mrb_value mrb_registry_add_system(
+    mrb_state* mrb, mrb_value self)
+  {
+    mrb_require_main_vm(mrb, self);
+    Derived* registry = mrb_value_to_registry(mrb, self);
+    if(!registry)
+      return mrb_nil_value();
+
+    char* name;
+    mrb_value reads, writes, block = mrb_nil_value();
+    mrb_get_args(mrb, "zoo&", &name, &reads, &writes, &block);
+    if(mrb_nil_p(block))
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
+    if(registry->mrb_scheduler.running)
+      mrb_raise(mrb, E_RUNTIME_ERROR, "can't add systems while systems are running");
+
+    auto read_types = mrb_registry_term_array(mrb, self, reads);
+    auto write_types = mrb_registry_term_array(mrb, self, writes);
+    const bool exclusive = mrb_nil_p(reads) && mrb_nil_p(writes);
+
+    auto& scheduler = registry->mrb_scheduler;
+    scheduler.add_ruby(
+      scheduler.add(name, std::move(read_types), std::move(write_types), exclusive),
+      block);
+    return self;
+  }
+
+  static mrb_value mrb_registry_remove_system(
+    mrb_state* mrb, mrb_value self)
+  {
+    mrb_require_main_vm(mrb, self);
+    Derived* registry = mrb_value_to_registry(mrb, self);
+    if(!registry)
+      return mrb_nil_value();
+
+    char* name;
+    mrb_get_args(mrb, "z", &name);
+    if(registry->mrb_scheduler.running)
+      mrb_raise(mrb, E_RUNTIME_ERROR, "can't remove systems while systems are running");
+    return mrb_bool_value(registry->mrb_scheduler.remove(name));
+  }
+
+  static mrb_value mrb_registry_run_systems(
+    mrb_state* mrb, mrb_value self)
+  {
+    mrb_require_main_vm(mrb, self);
+    Derived* registry = mrb_value_to_registry(mrb, self);
+    if(!registry)
+      return mrb_nil_value();
+
+    mrb_float dt = 0;
+    mrb_get_args(mrb, "|f", &dt);
+    if(registry->mrb_scheduler.running)
+      mrb_raise(mrb, E_RUNTIME_ERROR, "systems are already running");
+
+    // Nothing may unwind through run(), errors are raised once it returns
+    char message[256] = "";
+    mrb_value error = mrb_nil_value();
+    ++registry->mrb_commands.depth;
+    try
+    {
+      error = registry->mrb_scheduler.run(*registry, self, dt);
+    }
+    catch(const std::exception& e)
+    {
+      std::snprintf(message, sizeof(message), "native system failed: %s", e.what());
+    }
+    catch(...)
+    {
+      std::snprintf(message, sizeof(message), "native system failed");
+    }
+    --registry->mrb_commands.depth;
+    registry->template ctx< ChangeTracker >().advance();
+    // The systems that did finish keep their deferred commands
+    registry->mrb_flush(mrb);
+
+    if(message[0])
+      mrb_raise(mrb, E_RUNTIME_ERROR, message);
+    if(! mrb_nil_p(error))
+      mrb_exc_raise(mrb, error);
+    return self;
+  }
+
+  // { name => { last: ms, total: ms, runs: n } }
+  static mrb_value mrb_registry_system_timings(
+    mrb_state* mrb, mrb_value self)
+  {
+    Derived* registry = mrb_value_to_registry(mrb, self);
+    if(!registry)
+      return mrb_nil_value();
+
+    const auto& systems = registry->mrb_scheduler.systems;
+    mrb_value result = mrb_hash_new_capa(mrb, systems.size());
+    for(const auto& system : systems)
+    {
+      const auto& timing = system.timing;
+      mrb_value entry = mrb_hash_new_capa(mrb, 3);
+      mrb_hash_set(mrb, entry, mrb_symbol_value(mrb_intern_lit(mrb, "last")), mrb_float_value(mrb, timing.last_seconds * 1e3));
+      mrb_hash_set(mrb, entry, mrb_symbol_value(mrb_intern_lit(mrb, "total")), mrb_float_value(mrb, timing.total_seconds * 1e3));
+      mrb_hash_set(mrb, entry, mrb_symbol_value(mrb_intern_lit(mrb, "runs")), mrb_fixnum_value(timing.runs));
+      mrb_hash_set(mrb, result, mrb_str_new(mrb, timing.name.data(), timing.name.size()), entry);
+    }
+    return result;
+  }
+
+  static mrb_value mrb_registry_create(mrb_state* mrb, mrb_value self)
+  {
+    mrb_check_create(mrb, mrb_value_to_binding(mrb, self));
+    Derived* registry = mrb_value_to_registry(mrb, self);
+    if(!registry)
+      return mrb_nil_value();
+    ENTT_MRUBY_PROFILE_SCOPE(registry, create, -1);
+    auto entity = registry->create();
+    return mrb_fixnum_value(std::underlying_type_t< entt::entity >(entity));
+  }
+
+  // Destroy an entity along with its dynamic components
+  void mrb_destroy(entt::entity entity)
+  {
+    derived().template ctx< DynamicComponents >().remove_all(entity);
+    if(derived().valid(entity))
+      derived().destroy(entity);
+  }
+
+  // Destroy every entity along with its dynamic components
+  void mrb_clear()
+  {
+    derived().template ctx< DynamicComponents >().clear();
+    derived().clear();
+  }
+
+  // Save the entities, the static Components given and every dynamic
+  // component to path, see snapshot.h
+  template< typename... Components >
+  SnapshotResult mrb_save_snapshot(mrb_state* state, const std::string& path)
+  {
+    SnapshotWriter out;
+    if(! out.open(path))
+      return { 0, "can't open the snapshot file" };
+    out.header();
+
+    SnapshotOutputArchive archive{ out };
+    const entt::snapshot snapshot{ derived() };
+    snapshot.entities(archive);
+    if constexpr(sizeof...(Components) > 0)
+      snapshot.template component< Components... >(archive);
+
+    std::uint32_t names = 0;
+    for(const auto& entry : mrb_dynamic_components)
+      names += entry.second.is_dynamic;
+    out.u32(names);
+    for(const auto& [name, info] : mrb_dynamic_components)
+      if(info.is_dynamic)
+      {
+        out.u32(info.index);
+        out.u32(name.size());
+        out.write(name.data(), name.size());
+      }
+
+    const auto& dyn = derived().template ctx< DynamicComponents >();
+    std::uint32_t pools = 0;
+    for(const auto& pool : dyn.pools)
+      pools += pool != nullptr;
+    out.u32(pools);
+    for(std::size_t type = 0; type < dyn.pools.size(); ++type)
+      if(const auto& pool = dyn.pools[ type ])
+      {
+        out.u32(type);
+        out.u32(pool->size());
+        out.write(pool->data(), pool->size() * sizeof(entt::entity));
+        for(std::size_t i = 0; i < pool->size(); ++i)
+          if(! snapshot_encode(state, out, RARRAY_PTR(pool->values)[i]))
+          {
+            out.close();
+            std::remove(path.c_str());
+            return { 0, "a dynamic component holds a value that can't be saved" };
+          }
+      }
+
+    const auto bytes = out.written;
+    if(! out.close())
+      return { 0, "writing the snapshot failed" };
+    return { bytes, nullptr };
+  }
+
+  // Replace the registry's contents with a snapshot saved with the same
+  // static Components. Dynamic component ids are remapped by name. The
+  // snapshot is checked whole first, a bad one leaves the registry as is.
+  template< typename... Components >
+  SnapshotResult mrb_load_snapshot(mrb_state* state, const std::string& path)
+  {
+    if(mrb_commands.deferring() || mrb_scheduler.running)
+      return { 0, "can't load a snapshot while iterating" };
+
+    MappedFile file;
+    if(! file.open(path))
+      return { 0, "can't open the snapshot file" };
+    SnapshotReader in{ file.bytes, file.length };
+    if(! in.header())
+      return { 0, "not a snapshot, or one of another version" };
+
+    const std::vector< std::uint32_t > sections{ 0, snapshot_value_size< Components >()... };
+    const auto name_ok = [this](const char* name, std::size_t length)
+    {
+      // A name taken by a static component can't be remapped to
+      const auto iter = mrb_dynamic_components.find(std::string(name, length));
+      return iter == mrb_dynamic_components.cend() || iter->second.is_dynamic;
+    };
+    if(! snapshot_validate(in, sections, Derived::max_static_components, name_ok))
+      return { 0, "the snapshot is truncated or corrupt" };
+
+    mrb_clear();
+    // No orphans(), entities may hold nothing but dynamic components
+    SnapshotInputArchive archive{ in };
+    const entt::snapshot_loader loader{ derived() };
+    loader.entities(archive);
+    if constexpr(sizeof...(Components) > 0)
+      loader.template component< Components... >(archive);
+
+    std::unordered_map< std::uint32_t, mrb_int > ids;
+    const auto names = in.u32();
+    for(std::uint32_t i = 0; i < names && ! in.failed; ++i)
+    {
+      const auto saved = in.u32();
+      const auto length = in.u32();
+      if(const char* name = in.take(length))
+        ids[ saved ] = mrb_component_id(std::string(name, length));
+    }
+
+    auto& dyn = derived().template ctx< DynamicComponents >();
+    const auto pools = in.u32();
+    for(std::uint32_t i = 0; i < pools && ! in.failed; ++i)
+    {
+      const auto saved = in.u32();
+      const auto size = in.u32();
+      const char* entities = in.take(std::size_t(size) * sizeof(entt::entity));
+      const auto iter = ids.find(saved);
+      const mrb_int type = (iter != ids.cend()) ? iter->second : mrb_int(saved);
+      if(type < Derived::max_static_components)
+        in.failed = true;
+      if(in.failed)
+        break;
+      if(type >= derived().next_dynamic_component_id)
+        derived().next_dynamic_component_id = type + 1;
+
+      auto& pool = dyn.assure(type);
+      const int arena = mrb_gc_arena_save(state);
+      for(std::uint32_t j = 0; j < size && ! in.failed; ++j)
+      {
+        entt::entity entity;
+        std::memcpy(&entity, entities + std::size_t(j) * sizeof(entt::entity), sizeof(entt::entity));
+        const mrb_value value = snapshot_decode(state, in);
+        if(! in.failed && derived().valid(entity) && ! pool.contains(entity))
+        {
+          pool.emplace(state, entity, value);
+          dyn.notify(type, EventKind::construct, entity);
+        }
+        mrb_gc_arena_restore(state, arena);
+      }
+    }
+
+    if(in.failed)
+      return { 0, "the snapshot is truncated or corrupt" };
+    return { in.pos, nullptr };
+  }
+
+  // save_snapshot(path) => bytes written
+  template< typename... Components >
+  static mrb_value mrb_registry_save_snapshot(mrb_state* mrb, mrb_value self)
+  {
+    mrb_require_main_vm(mrb, self);
+    Derived* registry = mrb_value_to_registry(mrb, self);
+    if(!registry)
+      return mrb_nil_value();
+
+    char* path;
+    mrb_get_args(mrb, "z", &path);
+    const auto result = registry->template mrb_save_snapshot< Components... >(mrb, path);
+    if(! result)
+      mrb_raise(mrb, E_RUNTIME_ERROR, result.error);
+    return mrb_fixnum_value(result.bytes);
+  }
+
+  // load_snapshot(path), replaces every entity and component
+  template< typename... Components >
+  static mrb_value mrb_registry_load_snapshot(mrb_state* mrb, mrb_value self)
+  {
+    mrb_require_main_vm(mrb, self);
+    Derived* registry = mrb_value_to_registry(mrb, self);
+    if(!registry)
+      return mrb_nil_value();
+
+    char* path;
+    mrb_get_args(mrb, "z", &path);
+    const auto result = registry->template mrb_load_snapshot< Components... >(mrb, path);
+    if(! result)
+      mrb_raise(mrb, E_RUNTIME_ERROR, result.error);
+    registry->mrb_flush(mrb);
+    return self;
+  }
+
+  // Destroy entity now, or at the end of the iteration running
+  static mrb_value mrb_destroy_entity(mrb_state* mrb, MRubyRegistryPtr* binding, entt::entity entity)
+  {
+    mrb_require_main_vm(mrb, binding);
+    Derived* registry = binding->get();
+    if(! registry->valid(entity))
+      return mrb_false_value();
+    if(registry->mrb_commands.deferring())
+      registry->mrb_commands.record(Command::destroy, 0, entity);
+    else
+      registry->mrb_destroy(entity);
+    return mrb_true_value();
+  }
+
+  static mrb_value mrb_registry_destroy(mrb_state* mrb, mrb_value self)
+  {
+    mrb_require_main_vm(mrb, self);
+    MRubyRegistryPtr* binding = mrb_value_to_binding(mrb, self);
+    if(!binding || !binding->get())
+      return mrb_nil_value();
+
+    mrb_int entity;
+    if(mrb_get_args(mrb, "i", &entity) != 1)
+      return mrb_nil_value();
+
+    return mrb_destroy_entity(mrb, binding, entt::entity(entity));
+  }
+
+
+  using MrubyInvokeHandler = mrb_value(*)(mrb_state*, Derived*, ComponentFunctionSet&, mrb_int, mrb_int);
+
+  static bool mrb_registry_unpack(
+    mrb_state* mrb, mrb_value self,
+    mrb_int& entity, mrb_int& type, mrb_value*& arg,
+    mrb_int& arg_count,
+    MRubyRegistryPtr*& binding,
+    ComponentFunctionSet*& fn)
+  {
+    mrb_value component;
+    if(mrb_get_args(mrb, "io*", &entity, &component, &arg, &arg_count) < 2)
+      return false;
+
+    binding = mrb_value_to_binding(mrb, self);
+    if(!binding || !binding->get())
+      return false;
+
+    type = mrb_value_to_component_id(mrb, binding, component);
+
+    fn = binding->get()->mrb_component_functions(type);
+    return fn != nullptr;
+  }
+
+  static mrb_value mrb_registry_valid(
+    mrb_state* mrb, mrb_value self)
+  {
+    Derived* registry = mrb_value_to_registry(mrb, self);
+    if(!registry)
+      return mrb_nil_value();
+
+    mrb_int entity;
+    if(mrb_get_args(mrb, "i", &entity) != 1)
+      return mrb_nil_value();
+
+    return registry->valid(entt::entity(entity))
+      ? mrb_true_value()
+      : mrb_false_value();
+  }
+
+  // has?, get, set and remove once the arguments are resolved, shared by
+  // Registry and Entity
+
+  static mrb_value mrb_has_component(
+    mrb_state* mrb, MRubyRegistryPtr* binding, ComponentFunctionSet* fn,
+    mrb_int type, entt::entity entity)
+  {
+    Derived* ptr = binding->get();
+    ENTT_MRUBY_PROFILE_SCOPE(ptr, has, type);
+    return fn->has(mrb, *ptr, entity, type);
+  }
+
+  static mrb_value mrb_get_component(
+    mrb_state* mrb, MRubyRegistryPtr* binding, ComponentFunctionSet* fn,
+    mrb_int type, entt::entity entity)
+  {
+    Derived* ptr = binding->get();
+    ENTT_MRUBY_PROFILE_SCOPE(ptr, get, type);
+    return fn->get(mrb, *ptr, entity, type);
+  }
+
+  static mrb_value mrb_set_component(
+    mrb_state* mrb, MRubyRegistryPtr* binding, ComponentFunctionSet* fn,
+    mrb_int type, entt::entity entity, mrb_int arg_count, mrb_value* arg)
+  {
+    Derived* ptr = binding->get();
+    ENTT_MRUBY_PROFILE_SCOPE(ptr, set, type);
+    mrb_check_write(mrb, binding, fn, type, entity);
+    // Replacing in place is safe during iteration, adding is deferred
+    if(! binding->worker
+      && ptr->mrb_commands.deferring()
+      && ! mrb_test(fn->has(mrb, *ptr, entity, type)))
+    {
+      ptr->mrb_commands.record(Command::set, type, entity, arg_count, arg);
+      return arg_count == 1 ? arg[0] : mrb_true_value();
+    }
+    return fn->set(mrb, *ptr, entity, type, arg_count, arg);
+  }
+
+  static mrb_value mrb_remove_component(
+    mrb_state* mrb, MRubyRegistryPtr* binding, ComponentFunctionSet* fn,
+    mrb_int type, entt::entity entity)
+  {
+    Derived* ptr = binding->get();
+    ENTT_MRUBY_PROFILE_SCOPE(ptr, remove, type);
+    if(! binding->writes.allows(type))
+      mrb_raise(mrb, E_RUNTIME_ERROR, "component is not writable by this system");
+    if(binding->worker)
+      mrb_raise(mrb, E_RUNTIME_ERROR, "worker VMs can't remove components");
+    if(ptr->mrb_commands.deferring())
+    {
+      const bool has = mrb_test(fn->has(mrb, *ptr, entity, type));
+      if(has)
+        ptr->mrb_commands.record(Command::remove, type, entity);
+      return mrb_bool_value(has);
+    }
+    return fn->remove(mrb, *ptr, entity, type);
+  }
+
+  static mrb_value mrb_registry_has(
+    mrb_state* mrb, mrb_value self)
+  {
+    mrb_int entity, type;
+    mrb_value* arg;
+    mrb_int arg_count;
+    MRubyRegistryPtr* binding;
+    ComponentFunctionSet* fn;
+    if(mrb_registry_unpack(mrb, self, entity, type, arg, arg_count, binding, fn))
+      return mrb_has_component(mrb, binding, fn, type, (entt::entity)entity);
+    return mrb_nil_value();
+  }
+
+  static mrb_value mrb_registry_get(
+    mrb_state* mrb, mrb_value self)
+  {
+    mrb_int entity, type;
+    mrb_value* arg;
+    mrb_int arg_count;
+    MRubyRegistryPtr* binding;
+    ComponentFunctionSet* fn;
+    if(mrb_registry_unpack(mrb, self, entity, type, arg, arg_count, binding, fn))
+      return mrb_get_component(mrb, binding, fn, type, (entt::entity)entity);
+    return mrb_nil_value();
+  }
+
+  static mrb_value mrb_registry_set(
+    mrb_state* mrb, mrb_value self)
+  {
+    mrb_int entity, type;
+    mrb_value* arg;
+    mrb_int arg_count;
+    MRubyRegistryPtr* binding;
+    ComponentFunctionSet* fn;
+    if(mrb_registry_unpack(mrb, self, entity, type, arg, arg_count, binding, fn))
+      return mrb_set_component(mrb, binding, fn, type, (entt::entity)entity, arg_count, arg);
+    return mrb_nil_value();
+  }
+
+  static mrb_value mrb_registry_remove(
+    mrb_state* mrb, mrb_value self)
+  {
+    mrb_require_main_vm(mrb, self);
+    mrb_int entity, type;
+    mrb_value* arg;
+    mrb_int arg_count;
+    MRubyRegistryPtr* binding;
+    ComponentFunctionSet* fn;
+    if(mrb_registry_unpack(mrb, self, entity, type, arg, arg_count, binding, fn))
+      return mrb_remove_component(mrb, binding, fn, type, (entt::entity)entity);
+    return mrb_nil_value();
+  }
+
+  static mrb_value mrb_entity_new(mrb_state* mrb, MRubyRegistryPtr* binding, entt::entity entity)
+  {
+    return mrb_obj_value(Data_Wrap_Struct(mrb, binding->entity_class, &mrb_entity_data_type, mrb_entity_pack(entity)));
+  }
+
+  static bool mrb_is_entity(mrb_value value)
+  {
+    return mrb_type(value) == MRB_TT_DATA && DATA_TYPE(value) == &mrb_entity_data_type;
+  }
+
+  // The entity of a handle, and the binding of its mrb_state's registry
+  static MRubyRegistryPtr* mrb_entity_binding(mrb_state* mrb, mrb_value self, entt::entity& entity)
+  {
+    if(! mrb_is_entity(self))
+      mrb_raise(mrb, E_TYPE_ERROR, "not an initialized Entity");
+    entity = mrb_entity_unpack(DATA_PTR(self));
+    const mrb_value registry = mrb_mod_cv_get(mrb, mrb_obj_class(mrb, self), mrb_intern_lit(mrb, "registry"));
+    return mrb_value_to_binding(mrb, registry);
+  }
+
+  // An entity id, or an Entity
+  static entt::entity mrb_value_to_entity(mrb_state* mrb, mrb_value value)
+  {
+    if(mrb_is_entity(value))
+      return mrb_entity_unpack(DATA_PTR(value));
+    if(! mrb_fixnum_p(value))
+      mrb_raise(mrb, E_TYPE_ERROR, "entity must be an Integer or an Entity");
+    return entt::entity(mrb_fixnum(value));
+  }
+
+  // Resolve the component argument of an Entity method
+  static ComponentFunctionSet* mrb_entity_unpack_component(
+    mrb_state* mrb, mrb_value self,
+    entt::entity& entity, mrb_int& type, mrb_value*& arg,
+    mrb_int& arg_count,
+    MRubyRegistryPtr*& binding)
+  {
+    mrb_value component;
+    mrb_get_args(mrb, "o*", &component, &arg, &arg_count);
+    binding = mrb_entity_binding(mrb, self, entity);
+    if(!binding->get())
+      return nullptr;
+    type = mrb_value_to_component_id(mrb, binding, component);
+    return binding->get()->mrb_component_functions(type);
+  }
+
+  // Entity.new(registry, id)
+  static mrb_value mrb_entity_initialize(mrb_state* mrb, mrb_value self)
+  {
+    mrb_value registry, id;
+    mrb_get_args(mrb, "oo", &registry, &id);
+    mrb_value_to_binding(mrb, registry);
+    mrb_data_init(self, mrb_entity_pack(mrb_value_to_entity(mrb, id)), &mrb_entity_data_type);
+    return self;
+  }
+
+  // Makes dup and clone copy the entity
+  static mrb_value mrb_entity_initialize_copy(mrb_state* mrb, mrb_value self)
+  {
+    const mrb_value other = mrb_get_arg1(mrb);
+    if(! mrb_is_entity(other))
+      mrb_raise(mrb, E_TYPE_ERROR, "not an initialized Entity");
+    mrb_data_init(self, DATA_PTR(other), &mrb_entity_data_type);
+    return self;
+  }
+
+  static mrb_value mrb_entity_id(mrb_state* mrb, mrb_value self)
+  {
+    entt::entity entity;
+    mrb_entity_binding(mrb, self, entity);
+    return mrb_fixnum_value(entt::to_integral(entity));
+  }
+
+  static mrb_value mrb_entity_version(mrb_state* mrb, mrb_value self)
+  {
+    entt::entity entity;
+    mrb_entity_binding(mrb, self, entity);
+    return mrb_fixnum_value(Derived::version(entity));
+  }
+
+  static mrb_value mrb_entity_registry(mrb_state* mrb, mrb_value self)
+  {
+    return mrb_mod_cv_get(mrb, mrb_obj_class(mrb, self), mrb_intern_lit(mrb, "registry"));
+  }
+
+  static mrb_value mrb_entity_valid(mrb_state* mrb, mrb_value self)
+  {
+    entt::entity entity;
+    MRubyRegistryPtr* binding = mrb_entity_binding(mrb, self, entity);
+    return mrb_bool_value(binding->get() && binding->get()->valid(entity));
+  }
+
+  static mrb_value mrb_entity_has(mrb_state* mrb, mrb_value self)
+  {
+    entt::entity entity;
+    mrb_int type;
+    mrb_value* arg;
+    mrb_int arg_count;
+    MRubyRegistryPtr* binding;
+    if(auto fn = mrb_entity_unpack_component(mrb, self, entity, type, arg, arg_count, binding))
+      return mrb_has_component(mrb, binding, fn, type, entity);
+    return mrb_nil_value();
+  }
+
+  static mrb_value mrb_entity_get(mrb_state* mrb, mrb_value self)
+  {
+    entt::entity entity;
+    mrb_int type;
+    mrb_value* arg;
+    mrb_int arg_count;
+    MRubyRegistryPtr* binding;
+    if(auto fn = mrb_entity_unpack_component(mrb, self, entity, type, arg, arg_count, binding))
+      return mrb_get_component(mrb, binding, fn, type, entity);
+    return mrb_nil_value();
+  }
+
+  static mrb_value mrb_entity_set(mrb_state* mrb, mrb_value self)
+  {
+    entt::entity entity;
+    mrb_int type;
+    mrb_value* arg;
+    mrb_int arg_count;
+    MRubyRegistryPtr* binding;
+    if(auto fn = mrb_entity_unpack_component(mrb, self, entity, type, arg, arg_count, binding))
+      return mrb_set_component(mrb, binding, fn, type, entity, arg_count, arg);
+    return mrb_nil_value();
+  }
+
+  static mrb_value mrb_entity_remove(mrb_state* mrb, mrb_value self)
+  {
+    entt::entity entity;
+    mrb_int type;
+    mrb_value* arg;
+    mrb_int arg_count;
+    MRubyRegistryPtr* binding;
+    if(auto fn = mrb_entity_unpack_component(mrb, self, entity, type, arg, arg_count, binding))
+    {
+      mrb_require_main_vm(mrb, binding);
+      return mrb_remove_component(mrb, binding, fn, type, entity);
+    }
+    return mrb_nil_value();
+  }
+
+  static mrb_value mrb_entity_destroy(mrb_state* mrb, mrb_value self)
+  {
+    entt::entity entity;
+    MRubyRegistryPtr* binding = mrb_entity_binding(mrb, self, entity);
+    if(!binding->get())
+      return mrb_nil_value();
+    return mrb_destroy_entity(mrb, binding, entity);
+  }
+
+  // Handles are equal when they hold the same id and version
+  static mrb_value mrb_entity_equal(mrb_state* mrb, mrb_value self)
+  {
+    const mrb_value other = mrb_get_arg1(mrb);
+    return mrb_bool_value(mrb_is_entity(self) && mrb_is_entity(other) && DATA_PTR(self) == DATA_PTR(other));
+  }
+
+  static mrb_value mrb_entity_hash(mrb_state* mrb, mrb_value self)
+  {
+    entt::entity entity;
+    mrb_entity_binding(mrb, self, entity);
+    return mrb_fixnum_value(entt::to_integral(entity));
+  }
+
+  static mrb_value mrb_entity_inspect(mrb_state* mrb, mrb_value self)
+  {
+    entt::entity entity;
+    mrb_entity_binding(mrb, self, entity);
+    char text[64];
+    std::snprintf(text, sizeof(text), "#<Entity %lu v%lu>",
+      static_cast< unsigned long >(Derived::entity(entity)),
+      static_cast< unsigned long >(Derived::version(entity)));
+    return mrb_str_new_cstr(mrb, text);
+  }
+
+  static mrb_value mrb_registry_create_entity(mrb_state* mrb, mrb_value self)
+  {
+    MRubyRegistryPtr* binding = mrb_value_to_binding(mrb, self);
+    mrb_check_create(mrb, binding);
+    if(!binding || !binding->get())
+      return mrb_nil_value();
+    Derived* registry = binding->get();
+    ENTT_MRUBY_PROFILE_SCOPE(registry, create, -1);
+    return mrb_entity_new(mrb, binding, registry->create());
+  }
+
+  // entity(id), a handle to an existing entity
+  static mrb_value mrb_registry_entity(mrb_state* mrb, mrb_value self)
+  {
+    MRubyRegistryPtr* binding = mrb_value_to_binding(mrb, self);
+    if(!binding || !binding->get())
+      return mrb_nil_value();
+    return mrb_entity_new(mrb, binding, mrb_value_to_entity(mrb, mrb_get_arg1(mrb)));
+  }
+
+  // each_entity(*components) { |entity| }. The block gets the same handle
+  // for every entity, pointed at the next one each time; dup it to keep an
+  // entity past its iteration.
+  static mrb_value mrb_registry_each_entity(mrb_state* mrb, mrb_value self)
+  {
+    MRubyRegistryPtr* binding = mrb_value_to_binding(mrb, self);
+    if(!binding || !binding->get())
+      return mrb_nil_value();
+    Derived* registry = binding->get();
+
+    mrb_value block = mrb_nil_value();
+    mrb_value* args;
+    mrb_int size;
+    mrb_get_args(mrb, "*&", &args, &size, &block);
+    if(mrb_nil_p(block))
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
+
+    const auto types = mrb_registry_terms(mrb, self, args, size);
+    ENTT_MRUBY_PROFILE_SCOPE(registry, entities, types.empty() ? -1 : types[0]);
+
+    const mrb_value handle = mrb_entity_new(mrb, binding, entt::null);
+    mrb_iterate(mrb, self, [&]
+    {
+      const int arena = mrb_gc_arena_save(mrb);
+      registry->mrb_each_entity(types, [&](const entt::entity entity)
+      {
+        ENTT_MRUBY_PROFILE_YIELD();
+        DATA_PTR(handle) = mrb_entity_pack(entity);
+        mrb_yield(mrb, block, handle);
+        mrb_gc_arena_restore(mrb, arena);
+      });
+    });
+
+    return self;
+  }
+
+
+#ifdef ENTT_MRUBY_PROFILE
+  // Component names indexed by id, for profiling reports
+  std::vector< std::string > mrb_component_names() const
+  {
+    std::vector< std::string > names;
+    for(const auto& [name, info] : mrb_dynamic_components)
+    {
+      if(info.index >= names.size())
+        names.resize(info.index + 1);
+      names[ info.index ] = name;
+    }
+    return names;
+  }
+
+  // Labels trace events by component name
+  static auto mrb_trace_names(const std::vector< std::string >& names)
+  {
+    return [&names](mrb_int type)
+    {
+      if(type < 0)
+        return std::string("registry");
+      if(static_cast< std::size_t >(type) < names.size() && ! names[ type ].empty())
+        return names[ type ];
+      return std::to_string(type);
+    };
+  }
+
+  bool mrb_write_chrome_trace(const std::string& path)
+  {
+    const auto names = mrb_component_names();
+    return mrb_profiler.write_chrome_trace(path, mrb_trace_names(names));
+  }
+
+  // { binding => { component name, or nil => { calls:, ms:, objects:, yielded: } } }
+  static mrb_value mrb_registry_stats(mrb_state* mrb, mrb_value self)
+  {
+    Derived* registry = mrb_value_to_registry(mrb, self);
+    if(!registry)
+      return mrb_nil_value();
+
+    const auto names = registry->mrb_component_names();
+    mrb_value result = mrb_hash_new(mrb);
+    registry->mrb_profiler.each([&](ProfiledBinding binding, mrb_int type, const BindingCounters& counters)
+    {
+      const mrb_value key = mrb_symbol_value(mrb_intern_cstr(mrb, profiled_binding_name(binding)));
+      mrb_value table = mrb_hash_get(mrb, result, key);
+      if(mrb_nil_p(table))
+      {
+        table = mrb_hash_new(mrb);
+        mrb_hash_set(mrb, result, key, table);
+      }
+
+      mrb_value entry = mrb_hash_new_capa(mrb, 4);
+      mrb_hash_set(mrb, entry, mrb_symbol_value(mrb_intern_lit(mrb, "calls")), mrb_fixnum_value(counters.calls));
+      mrb_hash_set(mrb, entry, mrb_symbol_value(mrb_intern_lit(mrb, "ms")), mrb_float_value(mrb, counters.nanoseconds / 1e6));
+      mrb_hash_set(mrb, entry, mrb_symbol_value(mrb_intern_lit(mrb, "objects")), mrb_fixnum_value(counters.objects));
+      mrb_hash_set(mrb, entry, mrb_symbol_value(mrb_intern_lit(mrb, "yielded")), mrb_fixnum_value(counters.yielded));
+
+      mrb_value component = mrb_nil_value();
+      if(type >= 0 && static_cast< std::size_t >(type) < names.size() && ! names[ type ].empty())
+        component = mrb_str_new(mrb, names[ type ].data(), names[ type ].size());
+      else if(type >= 0)
+        component = mrb_fixnum_value(type);
+      mrb_hash_set(mrb, table, component, entry);
+    });
+    return result;
+  }
+
+  static mrb_value mrb_registry_reset_stats(mrb_state* mrb, mrb_value self)
+  {
+    Derived* registry = mrb_value_to_registry(mrb, self);
+    if(!registry)
+      return mrb_nil_value();
+    registry->mrb_profiler.reset();
+    return self;
+  }
+
+  // Record every profiled call until write_trace
+  static mrb_value mrb_registry_start_trace(mrb_state* mrb, mrb_value self)
+  {
+    Derived* registry = mrb_value_to_registry(mrb, self);
+    if(!registry)
+      return mrb_nil_value();
+    registry->mrb_profiler.start_trace();
+    return self;
+  }
+
+  // write_trace(path) => number of calls written, as Chrome trace JSON
+  static mrb_value mrb_registry_write_trace(mrb_state* mrb, mrb_value self)
+  {
+    Derived* registry = mrb_value_to_registry(mrb, self);
+    if(!registry)
+      return mrb_nil_value();
+
+    char* path;
+    mrb_get_args(mrb, "z", &path);
+    // Taken under the profiler's lock, worker VMs may still be recording.
+    // Scoped so nothing is left to destroy when raising.
+    std::size_t count;
+    bool written;
+    {
+      const auto trace = registry->mrb_profiler.take_trace();
+      const auto names = registry->mrb_component_names();
+      count = trace.size();
+      written = Profiler::write_chrome_trace(path, trace, mrb_trace_names(names));
+    }
+    if(! written)
+      mrb_raise(mrb, E_RUNTIME_ERROR, "can't write the trace file");
+    return mrb_fixnum_value(count);
+  }
+#endif
+
+  template< typename Component >
+  void mrb_init_component_name(mrb_state* state, RClass* ns)
+  {
+    std::string name = cpp_type_name_to_mrb(::MRuby::type_name< Component >());
+    auto id = entt::type_seq<Component>::value();
+    mrb_define_const(state, ns, name.c_str(), mrb_fixnum_value(id));
+    derived().mrb_dynamic_components[ name ] = _mrb_component_type_info<Component>();
+  }
+
+  template< typename... Components >
+  void mrb_init(mrb_state* state)
+  {
+    std::cout << "mrb_init< sizeof=" << sizeof...(Components) << std::endl ;
+    mrb_init_function_map<MRuby::ComponentInterface, MRuby::DynamicComponents, Components...>(
+      derived().mrb_func_map, derived());
+    auto& events = derived().template set< ComponentEvents >();
+    events.init(state);
+    auto& dyn = derived().template set< DynamicComponents >();
+    dyn.init(state);
+    dyn.events = &events;
+    dyn.changes = &derived().template set< ChangeTracker >();
+    mrb_scheduler.init(state);
+    mrb_gc_pacer.init(state);
+    mrb_commands.init(state);
+    // Create the storages up front, native systems on worker threads must
+    // not race on entt creating a pool
+    (derived().template view< Components >(), ...);
+
+    auto registry_class = mrb_define_registry_class< Components... >(state);
+
+    _mrb_entt_type_index_to_id.resize(std::max< std::size_t >({
+      std::size_t(Derived::max_static_components),
+      std::size_t(entt::type_seq< Components >::value() + 1)... }), 0);
+    ((_mrb_entt_type_index_to_id[ entt::type_seq<Components>::value() ] = entt::type_id<Components>().hash()), ...);
+    _mrb_event_connectors.resize(_mrb_entt_type_index_to_id.size(), nullptr);
+    ((_mrb_event_connectors[ entt::type_seq<Components>::value() ] = &ComponentEvents::connect< Components >), ...);
+    _mrb_change_connectors.resize(_mrb_entt_type_index_to_id.size(), nullptr);
+    ((_mrb_change_connectors[ entt::type_seq<Components>::value() ] = &ChangeTracker::connect< Components >), ...);
+    _mrb_sorters.resize(_mrb_entt_type_index_to_id.size(), ComponentSorter{});
+    ((_mrb_sorters[ entt::type_seq<Components>::value() ] = ComponentSorter::make< Components >()), ...);
+
+    auto registry_data = mrb_create_registry_object(state, registry_class, mrb_registry_object);
+    _mrb_main_binding = registry_data;
+
+    std::cout << //"registry_obj=" << registry_obj << 
+    " registry_data=" << registry_data << std::endl;
+  }
+
+  // Set up an interface to access the registry from ruby
+  template< typename... Components >
+  MRuby::Class mrb_define_registry_class(mrb_state* state)
+  {
+    watch_state_close(state);
+    auto registry_class = MRuby::Class::bind< MRubyRegistryPtr >(
+      state, "Registry", state->object_class);
+
+    registry_class
+      .define_method("create", Derived::mrb_registry_create, MRB_ARGS_REQ(0))
+      .define_method("destroy", Derived::mrb_registry_destroy, MRB_ARGS_REQ(1))
       .define_method("get", Derived::mrb_registry_get, MRB_ARGS_REQ(2))
       .define_method("set", Derived::mrb_registry_set, MRB_ARGS_REQ(2))
       .define_method("remove", Derived::mrb_registry_remove, MRB_ARGS_REQ(2))
       .define_method("has?", Derived::mrb_registry_has, MRB_ARGS_REQ(2))
       .define_method("valid?", Derived::mrb_registry_valid, MRB_ARGS_REQ(1))
+      .define_method("create_entity", Derived::mrb_registry_create_entity, MRB_ARGS_NONE())
+      .define_method("entity", Derived::mrb_registry_entity, MRB_ARGS_REQ(1))
+      .define_method("each_entity", Derived::mrb_registry_each_entity, MRB_ARGS_ANY())
+      .define_method("get_component", Derived::mrb_registry_get, MRB_ARGS_REQ(2))
+      .define_method("set_component", Derived::mrb_registry_set, MRB_ARGS_REQ(2))
       .define_method("component", Derived::mrb_registry_new_component, MRB_ARGS_REQ(1))
+      .define_method("component_id", Derived::mrb_registry_new_component, MRB_ARGS_REQ(1))
       .define_method("all_components", Derived::mrb_registry_get_components, MRB_ARGS_REQ(0))
       .define_method("entities", Derived::mrb_registry_entities, MRB_ARGS_ANY())
+      .define_method("each_with", Derived::mrb_registry_each_with, MRB_ARGS_ANY())
+      .define_method("group", Derived::mrb_registry_group, MRB_ARGS_OPT(1))
+      .define_method("query", Derived::mrb_registry_query, MRB_ARGS_OPT(1))
+      .define_method("sort", Derived::mrb_registry_sort, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1))
+      .define_method("sort_like", Derived::mrb_registry_sort_like, MRB_ARGS_REQ(2) | MRB_ARGS_OPT(1))
+      .define_method("get_many", Derived::mrb_registry_get_many, MRB_ARGS_REQ(2))
+      .define_method("set_many", Derived::mrb_registry_set_many, MRB_ARGS_REQ(3))
+      .define_method("column", Derived::mrb_registry_column, MRB_ARGS_REQ(2))
+      .define_method("add_system", Derived::mrb_registry_add_system, MRB_ARGS_REQ(3))
+      .define_method("remove_system", Derived::mrb_registry_remove_system, MRB_ARGS_REQ(1))
+      .define_method("run_systems", Derived::mrb_registry_run_systems, MRB_ARGS_OPT(1))
+      .define_method("system_timings", Derived::mrb_registry_system_timings, MRB_ARGS_NONE())
+      .define_method("flush", Derived::mrb_registry_flush, MRB_ARGS_NONE())
+      .define_method("on_construct", Derived::template mrb_registry_on< EventKind::construct >, MRB_ARGS_REQ(1))
+      .define_method("on_update", Derived::template mrb_registry_on< EventKind::update >, MRB_ARGS_REQ(1))
+      .define_method("on_destroy", Derived::template mrb_registry_on< EventKind::destroy >, MRB_ARGS_REQ(1))
+      .define_method("track_changes", Derived::mrb_registry_track_changes, MRB_ARGS_REQ(1))
+      .define_method("tick", Derived::mrb_registry_tick, MRB_ARGS_NONE())
+      .define_method("advance_tick", Derived::mrb_registry_advance_tick, MRB_ARGS_NONE())
+      .define_method("entities_changed_since", Derived::mrb_registry_entities_changed_since, MRB_ARGS_REQ(2))
+      .define_method("save_snapshot", Derived::template mrb_registry_save_snapshot< Components... >, MRB_ARGS_REQ(1))
+      .define_method("load_snapshot", Derived::template mrb_registry_load_snapshot< Components... >, MRB_ARGS_REQ(1))
+      .define_method("allocator_stats", Derived::mrb_registry_allocator_stats, MRB_ARGS_NONE())
+      .define_method("gc_pace", Derived::mrb_registry_gc_pace, MRB_ARGS_REQ(1))
+      .define_method("gc_step", Derived::mrb_registry_gc_step, MRB_ARGS_REQ(1))
+      .define_method("gc_generational", Derived::mrb_registry_gc_generational, MRB_ARGS_REQ(1))
+      .define_method("gc_stats", Derived::mrb_registry_gc_stats, MRB_ARGS_NONE())
+    ;
+
+#ifdef ENTT_MRUBY_PROFILE
+    registry_class
+      .define_method("stats", Derived::mrb_registry_stats, MRB_ARGS_NONE())
+      .define_method("reset_stats", Derived::mrb_registry_reset_stats, MRB_ARGS_NONE())
+      .define_method("start_trace", Derived::mrb_registry_start_trace, MRB_ARGS_NONE())
+      .define_method("write_trace", Derived::mrb_registry_write_trace, MRB_ARGS_REQ(1))
+    ;
+#endif
+
+    MRuby::Class::bind< entt::entity >(state, "Entity", state->object_class, Derived::mrb_entity_initialize)
+      .define_method("initialize_copy", Derived::mrb_entity_initialize_copy, MRB_ARGS_REQ(1))
+      .define_method("id", Derived::mrb_entity_id, MRB_ARGS_NONE())
+      .define_method("version", Derived::mrb_entity_version, MRB_ARGS_NONE())
+      .define_method("registry", Derived::mrb_entity_registry, MRB_ARGS_NONE())
+      .define_method("valid?", Derived::mrb_entity_valid, MRB_ARGS_NONE())
+      .define_method("has?", Derived::mrb_entity_has, MRB_ARGS_REQ(1))
+      .define_method("get", Derived::mrb_entity_get, MRB_ARGS_REQ(1))
+      .define_method("set", Derived::mrb_entity_set, MRB_ARGS_REQ(1))
+      .define_method("remove", Derived::mrb_entity_remove, MRB_ARGS_REQ(1))
+      .define_method("destroy", Derived::mrb_entity_destroy, MRB_ARGS_NONE())
+      .define_method("==", Derived::mrb_entity_equal, MRB_ARGS_REQ(1))
+      .define_method("eql?", Derived::mrb_entity_equal, MRB_ARGS_REQ(1))
+      .define_method("hash", Derived::mrb_entity_hash, MRB_ARGS_NONE())
+      .define_method("inspect", Derived::mrb_entity_inspect, MRB_ARGS_NONE())
+    ;
+
+    MRuby::Class::bind< ComponentGroupData, GroupBinder >(state, "Group", state->object_class)
+      .define_method("each", Derived::mrb_group_each, MRB_ARGS_BLOCK())
+      .define_method("size", Derived::mrb_group_size, MRB_ARGS_NONE())
+    ;
+
+    MRuby::Class::bind< ComponentQuery, QueryBinder >(state, "Query", state->object_class)
+      .define_method("each", Derived::mrb_query_each, MRB_ARGS_BLOCK())
+      .define_method("count", Derived::mrb_query_count, MRB_ARGS_NONE())
     ;
 
+    MRuby::define_columns(state);
     ((mrb_init_component_name<Components>(state, registry_class)), ...);
-    ((_mrb_entt_type_index_to_id[ entt::type_seq<Components>::value() ] = entt::type_id<Components>().hash()), ...);
-    _mrb_entt_type_index_to_id[ entt::type_seq<DynamicComponents>::value() ] = entt::type_id<DynamicComponents>().hash();
+    MRuby::ComponentInterface< MRuby::DynamicComponents >::init(state, registry_class);
+    ((MRuby::ComponentInterface< Components >::init(state, registry_class)), ...);
+    return registry_class;
+  }
 
-    // Create a registry object
-    auto registry_obj = registry_class.new_(0,nullptr);
+  // Create the Registry object of state, export it as "$registry" and
+  // "@registry" and load the helper methods
+  MRubyRegistryPtr* mrb_create_registry_object(mrb_state* state, MRuby::Class& registry_class, mrb_value& registry_obj)
+  {
+    registry_obj = registry_class.new_(0,nullptr);
     auto registry_data = (MRubyRegistryPtr*)DATA_PTR(registry_obj);
     registry_data->set(&derived());
+    set_write_mask(state, &registry_data->writes);
+    registry_data->entity_class = mrb_class_get(state, "Entity");
+    mrb_mod_cv_set(state, registry_data->entity_class, mrb_intern_lit(state, "registry"), registry_obj);
 
-    std::cout << //"registry_obj=" << registry_obj << 
-    " registry_data=" << registry_data << std::endl;
-
-    // Export it as "$registry" and "@registry"
     mrb_gv_set(state, mrb_intern_lit(state, "$registry"), registry_obj);
     mrb_iv_set(state, mrb_top_self(state), mrb_intern_lit(state, "@registry"), registry_obj);
 
-    // Load the helper methods and Entity class
     mrb_load_string(state, mruby_api);
+    return registry_data;
+  }
+
+  template< typename Component >
+  static void mrb_bind_component_symbol(mrb_state* state, MRubyRegistryPtr* binding)
+  {
+    const auto name = cpp_type_name_to_mrb(::MRuby::type_name< Component >());
+    const mrb_sym sym = mrb_intern(state, name.data(), name.size());
+    binding->symbol_ids[ sym ] = entt::type_seq< Component >::value();
+  }
+
+  // Start count more VMs over this registry for parallel script systems,
+  // each on its own thread. Call after mrb_init with the same components.
+  template< typename... Components >
+  void mrb_init_vm_pool(std::size_t count)
+  {
+    for(std::size_t i = 0; i < count; ++i)
+    {
+      mrb_state* state = mrb_open();
+      auto registry_class = mrb_define_registry_class< Components... >(state);
+      mrb_value registry_obj;
+      auto binding = mrb_create_registry_object(state, registry_class, registry_obj);
+      binding->worker = true;
+      binding->writes.enforced = true;
+      ((mrb_bind_component_symbol< Components >(state, binding)), ...);
+      mrb_vm_pool.add(state, registry_obj, binding->writes.writable);
+    }
+    mrb_vm_pool.start();
+  }
+
+  // Register a script system that every pool VM runs over its own slice of
+  // the entities having all of query. code must evaluate to a callable
+  // taking (registry, ids, dt). Only static component ids are accepted and
+  // only the components in writes may be replaced.
+  bool mrb_add_parallel_system(
+    const std::string& name, const std::string& code,
+    std::vector< mrb_int > query, std::vector< mrb_int > reads, std::vector< mrb_int > writes)
+  {
+    for(const auto* types : { &query, &reads, &writes })
+      for(const auto type : *types)
+        if(type < 0 || type >= Derived::max_static_components)
+          return false;
+
+    std::vector< bool > writable(Derived::max_static_components, false);
+    for(const auto type : writes)
+      writable[ type ] = true;
+    if(! mrb_vm_pool.load(name, code, std::move(writable)))
+      return false;
+
+    reads.insert(reads.end(), query.cbegin(), query.cend());
+    mrb_add_system(name, std::move(reads), std::move(writes),
+      [name, query](Derived& registry, double dt)
+      {
+        std::vector< entt::entity > entities;
+        registry.mrb_each_entity(query, [&entities](const entt::entity entity)
+        {
+          entities.push_back(entity);
+        });
+        if(! registry.mrb_vm_pool.run(name, entities, dt))
+          throw std::runtime_error("parallel system " + name + " raised");
+      });
+    return true;
   }
 
   void mrb_on_exception(mrb_state* state)
@@ -501,11 +2441,177 @@ struct RegistryMixin
 
   }
 
+  // Open a state whose heap comes from mrb_allocator instead of malloc. The
+  // state must be closed before the registry is destroyed.
+  mrb_state* mrb_open_pooled()
+  {
+    return mrb_open_allocf(&PoolAllocator::allocf, &mrb_allocator);
+  }
+
+  const AllocatorStats& mrb_allocator_stats() const
+  {
+    return mrb_allocator.stats;
+  }
+
+  static mrb_value mrb_registry_allocator_stats(mrb_state* mrb, mrb_value self)
+  {
+    Derived* registry = mrb_value_to_registry(mrb, self);
+    if(!registry)
+      return mrb_nil_value();
+
+    const auto& stats = registry->mrb_allocator.stats;
+    const std::pair< const char*, std::size_t > fields[] = {
+      { "allocations", stats.allocations },
+      { "frees", stats.frees },
+      { "reallocations", stats.reallocations },
+      { "reused", stats.reused },
+      { "large", stats.large },
+      { "bytes_in_use", stats.bytes_in_use },
+      { "peak_bytes", stats.peak_bytes },
+      { "chunk_bytes", stats.chunk_bytes }
+    };
+    mrb_value result = mrb_hash_new_capa(mrb, std::size(fields));
+    for(const auto& [name, value] : fields)
+      mrb_hash_set(mrb, result, mrb_symbol_value(mrb_intern_cstr(mrb, name)), mrb_fixnum_value(value));
+    return result;
+  }
+
+  // Collect only in mrb_gc_step, see GCPacer
+  void mrb_gc_pace(bool enable)
+  {
+    mrb_gc_pacer.pace(enable);
+  }
+
+  // Spend up to budget on garbage collection, at a quiet point of the frame
+  std::size_t mrb_gc_step(std::chrono::microseconds budget)
+  {
+    return mrb_gc_pacer.step(budget);
+  }
+
+  void mrb_gc_generational(bool enable)
+  {
+    mrb_gc_pacer.generational(enable);
+  }
+
+  const GCPacerStats& mrb_gc_stats() const
+  {
+    return mrb_gc_pacer.stats;
+  }
+
+  static mrb_value mrb_registry_gc_pace(mrb_state* mrb, mrb_value self)
+  {
+    mrb_require_main_vm(mrb, self);
+    Derived* registry = mrb_value_to_registry(mrb, self);
+    if(!registry)
+      return mrb_nil_value();
+    mrb_bool enable;
+    mrb_get_args(mrb, "b", &enable);
+    registry->mrb_gc_pace(enable);
+    return self;
+  }
+
+  // gc_step(budget_us) => steps taken
+  static mrb_value mrb_registry_gc_step(mrb_state* mrb, mrb_value self)
+  {
+    mrb_require_main_vm(mrb, self);
+    Derived* registry = mrb_value_to_registry(mrb, self);
+    if(!registry)
+      return mrb_nil_value();
+    mrb_int budget;
+    mrb_get_args(mrb, "i", &budget);
+    if(budget < 0)
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "negative budget");
+    return mrb_fixnum_value(registry->mrb_gc_step(std::chrono::microseconds(budget)));
+  }
+
+  static mrb_value mrb_registry_gc_generational(mrb_state* mrb, mrb_value self)
+  {
+    mrb_require_main_vm(mrb, self);
+    Derived* registry = mrb_value_to_registry(mrb, self);
+    if(!registry)
+      return mrb_nil_value();
+    mrb_bool enable;
+    mrb_get_args(mrb, "b", &enable);
+    registry->mrb_gc_generational(enable);
+    return self;
+  }
+
+  // { steps:, cycles:, forced:, pauses:, p50:, p99:, max:, histogram: [] },
+  // times in microseconds
+  static mrb_value mrb_registry_gc_stats(mrb_state* mrb, mrb_value self)
+  {
+    Derived* registry = mrb_value_to_registry(mrb, self);
+    if(!registry)
+      return mrb_nil_value();
+
+    const auto& stats = registry->mrb_gc_pacer.stats;
+    const auto& pauses = stats.pauses;
+    mrb_value histogram = mrb_ary_new_capa(mrb, PauseHistogram::bucket_count);
+    for(const auto count : pauses.buckets)
+      mrb_ary_push(mrb, histogram, mrb_fixnum_value(count));
+
+    const auto key = [mrb](const char* name)
+    {
+      return mrb_symbol_value(mrb_intern_cstr(mrb, name));
+    };
+    mrb_value result = mrb_hash_new_capa(mrb, 8);
+    mrb_hash_set(mrb, result, key("steps"), mrb_fixnum_value(stats.steps));
+    mrb_hash_set(mrb, result, key("cycles"), mrb_fixnum_value(stats.cycles));
+    mrb_hash_set(mrb, result, key("forced"), mrb_fixnum_value(stats.forced));
+    mrb_hash_set(mrb, result, key("pauses"), mrb_fixnum_value(pauses.count));
+    mrb_hash_set(mrb, result, key("p50"), mrb_float_value(mrb, pauses.percentile(50)));
+    mrb_hash_set(mrb, result, key("p99"), mrb_float_value(mrb, pauses.percentile(99)));
+    mrb_hash_set(mrb, result, key("max"), mrb_float_value(mrb, pauses.max_seconds * 1e6));
+    mrb_hash_set(mrb, result, key("histogram"), histogram);
+    return result;
+  }
+
+  // Compiled scripts are reused once enabled, and optionally stored on disk
+  void mrb_enable_bytecode_cache(mrb_state* state, const std::string& directory = std::string())
+  {
+    mrb_bytecode_cache.enable(state, directory);
+  }
+
+  const BytecodeCacheStats& mrb_bytecode_cache_stats() const
+  {
+    return mrb_bytecode_cache.stats;
+  }
+
   mrb_value mrb_load_file(mrb_state* state, const std::string& path)
   {
-    auto fp = fopen(path.c_str(), "r");
-    mrb_value val = ::mrb_load_file(state, fp);
-    fclose(fp);
+    mrb_value val;
+    if(mrb_bytecode_cache.enabled(state))
+      val = mrb_bytecode_cache.load_file(path);
+    else
+    {
+      auto fp = fopen(path.c_str(), "r");
+      val = ::mrb_load_file(state, fp);
+      fclose(fp);
+    }
+
+    if(state->exc)
+    {
+        derived().mrb_on_exception(state);
+        return mrb_nil_value();
+    }
+
+    return val;
+  }
+
+  // Evaluate the text of a file, through the bytecode cache if enabled and
+  // cached is set
+  mrb_value mrb_eval_source(mrb_state* state, const std::string& code, const std::string& path, bool cached = true)
+  {
+    mrb_value val;
+    if(cached && mrb_bytecode_cache.enabled(state))
+      val = mrb_bytecode_cache.eval(code.data(), code.size(), path.c_str());
+    else
+    {
+      mrbc_context* context = mrbc_context_new(state);
+      mrbc_filename(state, context, path.c_str());
+      val = mrb_load_nstring_cxt(state, code.data(), code.size(), context);
+      mrbc_context_free(state, context);
+    }
 
     if(state->exc)
     {
@@ -516,9 +2622,51 @@ struct RegistryMixin
     return val;
   }
 
+  // Load path like mrb_load_file and have mrb_reload_scripts re-evaluate it
+  // whenever its text changes
+  mrb_value mrb_watch_file(mrb_state* state, const std::string& path)
+  {
+    std::string code;
+    if(! BytecodeCache::read_source(path, code))
+    {
+      std::cout << "mrb_watch_file: unable to read " << path << std::endl;
+      return mrb_nil_value();
+    }
+    if(! mrb_script_watcher.add(path, hash_script(code.data(), code.size())))
+      std::cout << "mrb_watch_file: unable to watch " << path << std::endl;
+    return mrb_eval_source(state, code, path);
+  }
+
+  // Re-evaluate the watched files that changed, in the same state, so the
+  // registry's contents and component ids carry over. Meant to be called
+  // between frames; it does nothing while systems or iterations run.
+  // Reloads bypass the bytecode cache, which never evicts, so an editing
+  // session doesn't keep every saved version of a file compiled.
+  std::size_t mrb_reload_scripts(mrb_state* state)
+  {
+    if(mrb_scheduler.running || mrb_commands.deferring())
+      return 0;
+    return mrb_script_watcher.poll([this, state](const std::string& path, const std::string& code)
+    {
+      const int arena = mrb_gc_arena_save(state);
+      mrb_eval_source(state, code, path, false);
+      const bool raised = state->exc != nullptr;
+      state->exc = nullptr;
+      mrb_gc_arena_restore(state, arena);
+      return ! raised;
+    });
+  }
+
+  const ScriptReloadStats& mrb_reload_stats() const
+  {
+    return mrb_script_watcher.stats;
+  }
+
   mrb_value mrb_eval(mrb_state* state, const std::string& code)
   {
-    mrb_value val = mrb_load_string(state, code.c_str());
+    mrb_value val = mrb_bytecode_cache.enabled(state)
+      ? mrb_bytecode_cache.eval(code.data(), code.size())
+      : mrb_load_string(state, code.c_str());
 
     if(state->exc)
     {
@@ -530,8 +2678,4 @@ struct RegistryMixin
   }
 };
 
-
-template< typename Derived >
-std::unordered_map< entt::id_type, entt::id_type > RegistryMixin<Derived>::_mrb_entt_type_index_to_id;
-
 } // ::MRuby
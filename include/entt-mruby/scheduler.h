@@ -0,0 +1,378 @@
+#pragma once
+
+#include <mruby.h>
+#include <mruby/array.h>
+#include <mruby/error.h>
+
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <exception>
+#include <functional>
+
+namespace MRuby
+{
+
+// Fixed set of threads draining a shared task queue
+struct WorkerPool
+{
+  std::vector< std::thread > threads;
+  std::deque< std::function< void() > > tasks;
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool stopping = false;
+
+  WorkerPool() = default;
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator= (const WorkerPool&) = delete;
+
+  ~WorkerPool()
+  {
+    stop();
+  }
+
+  bool started() const
+  {
+    return ! threads.empty();
+  }
+
+  void start(std::size_t count)
+  {
+    stop();
+    stopping = false;
+    for(std::size_t i = 0; i < count; ++i)
+      threads.emplace_back([this] { work(); });
+  }
+
+  void stop()
+  {
+    {
+      std::lock_guard< std::mutex > lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for(auto& thread : threads)
+      thread.join();
+    threads.clear();
+  }
+
+  void push(std::function< void() > task)
+  {
+    {
+      std::lock_guard< std::mutex > lock(mutex);
+      tasks.push_back(std::move(task));
+    }
+    wake.notify_one();
+  }
+
+private:
+  void work()
+  {
+    for(;;)
+    {
+      std::function< void() > task;
+      {
+        std::unique_lock< std::mutex > lock(mutex);
+        wake.wait(lock, [this] { return stopping || ! tasks.empty(); });
+        if(tasks.empty())
+          return;
+        task = std::move(tasks.front());
+        tasks.pop_front();
+      }
+      task();
+    }
+  }
+};
+
+struct SystemTiming
+{
+  std::string name;
+  double last_seconds = 0, total_seconds = 0;
+  std::size_t runs = 0;
+};
+
+// A unit of per-frame work with the component ids it reads and writes.
+// Systems without declared sets are exclusive and conflict with all others.
+template< typename Registry >
+struct System
+{
+  using Native = std::function< void(Registry&, double) >;
+
+  SystemTiming timing;
+  std::vector< mrb_int > reads, writes;
+  bool exclusive = false;
+  // Ruby systems, and native systems touching dynamic components whose
+  // values live in the VM, run on the thread that owns the mrb_state
+  bool on_vm = false;
+  Native native;
+  mrb_int block = -1;
+
+  bool touches(mrb_int type) const
+  {
+    return std::find(reads.cbegin(), reads.cend(), type) != reads.cend()
+      || std::find(writes.cbegin(), writes.cend(), type) != writes.cend();
+  }
+
+  bool conflicts(const System& other) const
+  {
+    if(exclusive || other.exclusive)
+      return true;
+    for(const auto type : writes)
+      if(other.touches(type))
+        return true;
+    for(const auto type : other.writes)
+      if(touches(type))
+        return true;
+    return false;
+  }
+};
+
+// Runs registered systems once per frame. Each system waits on the earlier
+// systems it conflicts with; otherwise native systems run on the worker
+// pool while the VM thread works through the Ruby ones.
+template< typename Registry >
+struct Scheduler
+{
+  using SystemType = System< Registry >;
+
+  mrb_state* state = nullptr;
+  mrb_value blocks = mrb_nil_value();
+  std::vector< SystemType > systems;
+  WorkerPool workers;
+  // Systems can't be added or removed while a frame is running
+  bool running = false;
+  std::size_t worker_count = std::max(1u, std::thread::hardware_concurrency()) - 1;
+
+  void init(mrb_state* state)
+  {
+    this->state = state;
+    blocks = mrb_ary_new(state);
+    mrb_gc_register(state, blocks);
+  }
+
+  SystemType& add(const std::string& name, std::vector< mrb_int > reads, std::vector< mrb_int > writes, bool exclusive)
+  {
+    auto iter = std::find_if(systems.begin(), systems.end(), [&name](const auto& system)
+    {
+      return system.timing.name == name;
+    });
+    if(iter == systems.end())
+      iter = systems.insert(systems.end(), SystemType{});
+    else
+      release_block(*iter);
+
+    *iter = SystemType{};
+    iter->timing.name = name;
+    iter->reads = std::move(reads);
+    iter->writes = std::move(writes);
+    iter->exclusive = exclusive;
+    return *iter;
+  }
+
+  // Takes the first slot released by a replaced or removed system, so hot
+  // reloading doesn't keep growing blocks
+  void add_ruby(SystemType& system, mrb_value block)
+  {
+    system.on_vm = true;
+    const mrb_int size = RARRAY_LEN(blocks);
+    for(mrb_int i = 0; i < size; ++i)
+      if(mrb_nil_p(mrb_ary_entry(blocks, i)))
+      {
+        system.block = i;
+        mrb_ary_set(state, blocks, i, block);
+        return;
+      }
+    system.block = size;
+    mrb_ary_push(state, blocks, block);
+  }
+
+  bool remove(const std::string& name)
+  {
+    const auto iter = std::find_if(systems.begin(), systems.end(), [&name](const auto& system)
+    {
+      return system.timing.name == name;
+    });
+    if(iter == systems.end())
+      return false;
+    release_block(*iter);
+    systems.erase(iter);
+    return true;
+  }
+
+  // Runs every system once. Returns the exception raised by a Ruby system,
+  // or nil; native exceptions are rethrown. Either way the frame is
+  // finished before returning, so nothing is left running.
+  mrb_value run(Registry& registry, mrb_value self, double dt)
+  {
+    running = true;
+    const auto count = systems.size();
+    std::vector< std::vector< std::size_t > > dependents(count);
+    std::vector< std::size_t > pending(count, 0);
+    for(std::size_t j = 0; j < count; ++j)
+      for(std::size_t i = 0; i < j; ++i)
+        if(systems[i].conflicts(systems[j]))
+        {
+          dependents[i].push_back(j);
+          ++pending[j];
+        }
+
+    if(worker_count && ! workers.started())
+      workers.start(worker_count);
+
+    std::mutex mutex;
+    std::condition_variable finished_cv;
+    std::vector< std::size_t > finished;
+    std::deque< std::size_t > ready_vm;
+    std::exception_ptr native_error;
+    mrb_value ruby_error = mrb_nil_value();
+
+    const auto timed = [this](std::size_t index, auto&& fn)
+    {
+      const auto start = std::chrono::steady_clock::now();
+      fn();
+      const auto end = std::chrono::steady_clock::now();
+      auto& timing = systems[ index ].timing;
+      timing.last_seconds = std::chrono::duration< double >(end - start).count();
+      timing.total_seconds += timing.last_seconds;
+      ++timing.runs;
+    };
+
+    const auto dispatch = [&](std::size_t index)
+    {
+      auto& system = systems[ index ];
+      if(system.on_vm || ! worker_count)
+      {
+        ready_vm.push_back(index);
+        return;
+      }
+      workers.push([&, index]
+      {
+        try
+        {
+          timed(index, [&] { systems[ index ].native(registry, dt); });
+        }
+        catch(...)
+        {
+          std::lock_guard< std::mutex > lock(mutex);
+          if(! native_error)
+            native_error = std::current_exception();
+        }
+        // Notify under the lock, run() may return and take the condition
+        // variable with it as soon as it sees the last system finish
+        std::lock_guard< std::mutex > lock(mutex);
+        finished.push_back(index);
+        finished_cv.notify_one();
+      });
+    };
+
+    std::unique_lock< std::mutex > lock(mutex);
+    for(std::size_t i = 0; i < count; ++i)
+      if(! pending[i])
+        dispatch(i);
+
+    std::size_t done = 0;
+    while(done < count)
+    {
+      if(! ready_vm.empty())
+      {
+        const auto index = ready_vm.front();
+        ready_vm.pop_front();
+        lock.unlock();
+        run_on_vm(registry, self, dt, index, timed, ruby_error, native_error, mutex);
+        lock.lock();
+        finished.push_back(index);
+      }
+      else if(finished.empty())
+        finished_cv.wait(lock, [&finished] { return ! finished.empty(); });
+
+      for(const auto index : finished)
+      {
+        ++done;
+        for(const auto dependent : dependents[ index ])
+          if(! --pending[ dependent ])
+            dispatch(dependent);
+      }
+      finished.clear();
+    }
+    lock.unlock();
+    running = false;
+
+    if(native_error)
+      std::rethrow_exception(native_error);
+    return ruby_error;
+  }
+
+  const SystemTiming* timing(const std::string& name) const
+  {
+    for(const auto& system : systems)
+      if(system.timing.name == name)
+        return &system.timing;
+    return nullptr;
+  }
+
+private:
+  // Unroots a Ruby system's block and frees its slot
+  void release_block(SystemType& system)
+  {
+    if(system.block >= 0)
+      mrb_ary_set(state, blocks, system.block, mrb_nil_value());
+    system.block = -1;
+  }
+
+  static mrb_value call_block(mrb_state* state, mrb_value args)
+  {
+    return mrb_yield_argv(state, RARRAY_PTR(args)[0], 2, RARRAY_PTR(args) + 1);
+  }
+
+  template< typename Timed >
+  void run_on_vm(
+    Registry& registry, mrb_value self, double dt, std::size_t index, Timed& timed,
+    mrb_value& ruby_error, std::exception_ptr& native_error, std::mutex& mutex)
+  {
+    auto& system = systems[ index ];
+    if(system.block < 0)
+    {
+      try
+      {
+        timed(index, [&] { system.native(registry, dt); });
+      }
+      catch(...)
+      {
+        std::lock_guard< std::mutex > lock(mutex);
+        if(! native_error)
+          native_error = std::current_exception();
+      }
+      return;
+    }
+
+    // Ruby exceptions are caught here, unwinding past this frame would
+    // leave workers writing to a stack that no longer exists
+    // Native systems may be running meanwhile, so the block is held to the
+    // components it declared it writes
+    if(! system.exclusive)
+      registry.mrb_confine_writes(&system.writes);
+    const int arena = mrb_gc_arena_save(state);
+    mrb_value args[] = { mrb_ary_entry(blocks, system.block), self, mrb_float_value(state, dt) };
+    mrb_bool raised = FALSE;
+    mrb_value result;
+    timed(index, [&]
+    {
+      result = mrb_protect(state, call_block, mrb_ary_new_from_values(state, 3, args), &raised);
+    });
+    mrb_gc_arena_restore(state, arena);
+    if(! system.exclusive)
+      registry.mrb_confine_writes(nullptr);
+    if(raised && mrb_nil_p(ruby_error))
+    {
+      ruby_error = result;
+      mrb_gc_protect(state, ruby_error);
+    }
+  }
+};
+
+} // ::MRuby
@@ -0,0 +1,178 @@
+#pragma once
+
+#include "bytecode-cache.h"
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+namespace MRuby
+{
+
+struct ScriptReloadStats
+{
+  std::size_t reloads = 0, unchanged = 0, failures = 0;
+  // Read, compile and evaluate time of reloaded files
+  double last_seconds = 0, max_seconds = 0, total_seconds = 0;
+};
+
+// Script files that are re-evaluated when they change on disk. On Linux the
+// files' directories are watched with inotify, which also catches editors
+// that save by replacing the file; elsewhere poll() compares modification
+// times. A file whose text hashes the same as last time isn't reparsed.
+struct ScriptWatcher
+{
+  struct Script
+  {
+    std::string path, directory, name;
+    std::uint64_t hash = 0;
+    std::int64_t modified = 0;
+  };
+
+  int fd = -1;
+  // inotify watch descriptor to directory
+  std::unordered_map< int, std::string > directories;
+  std::vector< Script > scripts;
+  ScriptReloadStats stats;
+
+  ScriptWatcher() = default;
+  ScriptWatcher(const ScriptWatcher&) = delete;
+  ScriptWatcher& operator= (const ScriptWatcher&) = delete;
+
+  ~ScriptWatcher()
+  {
+    if(fd >= 0)
+      ::close(fd);
+  }
+
+  static std::int64_t modified_time(const std::string& path)
+  {
+    struct stat info;
+    if(::stat(path.c_str(), &info) != 0)
+      return 0;
+    return static_cast< std::int64_t >(info.st_mtime);
+  }
+
+  // Watch path, whose current text hashes to hash
+  bool add(const std::string& path, std::uint64_t hash)
+  {
+    for(auto& script : scripts)
+      if(script.path == path)
+      {
+        script.hash = hash;
+        return true;
+      }
+
+    Script script;
+    script.path = path;
+    const auto slash = path.rfind('/');
+    script.directory = (slash == std::string::npos) ? "." : path.substr(0, slash);
+    script.name = (slash == std::string::npos) ? path : path.substr(slash + 1);
+    script.hash = hash;
+    script.modified = modified_time(path);
+
+#ifdef __linux__
+    if(fd < 0)
+      fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(fd < 0)
+      return false;
+    const int watch = inotify_add_watch(fd, script.directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+    if(watch < 0)
+      return false;
+    directories[ watch ] = script.directory;
+#endif
+    scripts.push_back(std::move(script));
+    return true;
+  }
+
+  // Calls eval(path, code) for every watched file whose text changed,
+  // eval returns false if it raised. Returns the number of files reloaded.
+  template< typename Eval >
+  std::size_t poll(Eval&& eval)
+  {
+    std::size_t reloaded = 0;
+    for(const auto index : changed())
+    {
+      auto& script = scripts[ index ];
+      const auto start = std::chrono::steady_clock::now();
+      std::string code;
+      if(! BytecodeCache::read_source(script.path, code))
+        continue;
+      const auto hash = hash_script(code.data(), code.size());
+      if(hash == script.hash)
+      {
+        ++stats.unchanged;
+        continue;
+      }
+      // Remembered even if it fails, the same broken text isn't retried
+      script.hash = hash;
+
+      const bool ok = eval(script.path, code);
+      const double seconds = std::chrono::duration< double >(std::chrono::steady_clock::now() - start).count();
+      if(! ok)
+      {
+        ++stats.failures;
+        continue;
+      }
+      ++reloaded;
+      ++stats.reloads;
+      stats.last_seconds = seconds;
+      stats.max_seconds = std::max(stats.max_seconds, seconds);
+      stats.total_seconds += seconds;
+    }
+    return reloaded;
+  }
+
+private:
+  // Indices of the scripts that may have changed since the last call
+  std::vector< std::size_t > changed()
+  {
+    std::vector< std::size_t > indices;
+#ifdef __linux__
+    if(fd < 0)
+      return indices;
+    alignas(inotify_event) char buffer[ 4096 ];
+    for(;;)
+    {
+      const auto size = ::read(fd, buffer, sizeof(buffer));
+      if(size <= 0)
+        break;
+      for(auto at = buffer; at < buffer + size; )
+      {
+        const auto event = reinterpret_cast< const inotify_event* >(at);
+        at += sizeof(inotify_event) + event->len;
+        const auto directory = directories.find(event->wd);
+        if(directory == directories.cend() || ! event->len)
+          continue;
+        for(std::size_t i = 0; i < scripts.size(); ++i)
+          if(scripts[i].name == event->name && scripts[i].directory == directory->second)
+            indices.push_back(i);
+      }
+    }
+    std::sort(indices.begin(), indices.end());
+    indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+#else
+    for(std::size_t i = 0; i < scripts.size(); ++i)
+    {
+      const auto modified = modified_time(scripts[i].path);
+      if(modified != scripts[i].modified)
+      {
+        scripts[i].modified = modified;
+        indices.push_back(i);
+      }
+    }
+#endif
+    return indices;
+  }
+};
+
+} // ::MRuby
@@ -0,0 +1,660 @@
+#pragma once
+
+#include <mruby.h>
+#include <mruby/array.h>
+#include <mruby/hash.h>
+#include <mruby/string.h>
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define ENTT_MRUBY_MMAP 1
+#endif
+
+namespace MRuby
+{
+
+// Snapshot layout, integers are stored in host byte order:
+//
+//   header    "EMRS", u32 version
+//   sections  written by entt::snapshot, the entities and then each static
+//             component: u32 count, u32 value size, count entity ids,
+//             count * size bytes of component values
+//   names     u32 count, then per dynamic component u32 id, u32 length and
+//             the name, so ids can be remapped on load
+//   pools     u32 count, then per dynamic pool u32 id, u32 size, size
+//             entity ids and size encoded Ruby values
+//
+// Ruby values are a tag byte followed by a varint, a double, or a length
+// and that many bytes or nested values.
+constexpr char snapshot_magic[4] = { 'E', 'M', 'R', 'S' };
+constexpr std::uint32_t snapshot_version = 1;
+// Deepest nesting of Arrays and Hashes, also stops cyclic values
+constexpr int snapshot_max_depth = 64;
+
+enum SnapshotTag : std::uint8_t
+{
+  snapshot_nil,
+  snapshot_false,
+  snapshot_true,
+  snapshot_fixnum,
+  snapshot_float,
+  snapshot_string,
+  snapshot_symbol,
+  snapshot_array,
+  snapshot_hash
+};
+
+struct SnapshotResult
+{
+  std::size_t bytes = 0;
+  const char* error = nullptr;
+
+  explicit operator bool() const
+  {
+    return ! error;
+  }
+};
+
+// Buffered output to a file, large blocks bypass the buffer
+struct SnapshotWriter
+{
+  std::FILE* file = nullptr;
+  std::vector< char > buffer;
+  std::size_t written = 0;
+  bool failed = false;
+
+  SnapshotWriter() = default;
+  SnapshotWriter(const SnapshotWriter&) = delete;
+  SnapshotWriter& operator= (const SnapshotWriter&) = delete;
+
+  ~SnapshotWriter()
+  {
+    close();
+  }
+
+  bool open(const std::string& path)
+  {
+    file = std::fopen(path.c_str(), "wb");
+    buffer.reserve(1 << 20);
+    return file != nullptr;
+  }
+
+  bool close()
+  {
+    if(! file)
+      return ! failed;
+    flush();
+    failed |= std::fclose(file) != 0;
+    file = nullptr;
+    return ! failed;
+  }
+
+  void flush()
+  {
+    if(! buffer.empty() && std::fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size())
+      failed = true;
+    buffer.clear();
+  }
+
+  void write(const void* data, std::size_t size)
+  {
+    written += size;
+    if(buffer.size() + size > buffer.capacity())
+    {
+      flush();
+      if(size >= buffer.capacity())
+      {
+        if(std::fwrite(data, 1, size, file) != size)
+          failed = true;
+        return;
+      }
+    }
+    const auto at = buffer.size();
+    buffer.resize(at + size);
+    std::memcpy(buffer.data() + at, data, size);
+  }
+
+  void u8(std::uint8_t value)
+  {
+    write(&value, 1);
+  }
+
+  void u32(std::uint32_t value)
+  {
+    write(&value, sizeof(value));
+  }
+
+  void varint(std::uint64_t value)
+  {
+    std::uint8_t bytes[10];
+    std::size_t size = 0;
+    while(value >= 0x80)
+    {
+      bytes[ size++ ] = std::uint8_t(value) | 0x80;
+      value >>= 7;
+    }
+    bytes[ size++ ] = std::uint8_t(value);
+    write(bytes, size);
+  }
+
+  void header()
+  {
+    write(snapshot_magic, sizeof(snapshot_magic));
+    u32(snapshot_version);
+  }
+};
+
+// Bounds checked reads from a block of memory. Once a read fails every
+// later read returns zeros.
+struct SnapshotReader
+{
+  const char* data = nullptr;
+  std::size_t size = 0, pos = 0;
+  bool failed = false;
+
+  const char* take(std::size_t count)
+  {
+    if(failed || count > size - pos)
+    {
+      failed = true;
+      return nullptr;
+    }
+    const char* at = data + pos;
+    pos += count;
+    return at;
+  }
+
+  void read(void* output, std::size_t count)
+  {
+    if(const char* at = take(count))
+      std::memcpy(output, at, count);
+    else
+      std::memset(output, 0, count);
+  }
+
+  std::uint8_t u8()
+  {
+    std::uint8_t value;
+    read(&value, 1);
+    return value;
+  }
+
+  std::uint32_t u32()
+  {
+    std::uint32_t value;
+    read(&value, sizeof(value));
+    return value;
+  }
+
+  std::uint64_t varint()
+  {
+    std::uint64_t value = 0;
+    for(int shift = 0; shift < 64; shift += 7)
+    {
+      const auto byte = u8();
+      value |= std::uint64_t(byte & 0x7f) << shift;
+      if(! (byte & 0x80))
+        return value;
+    }
+    failed = true;
+    return 0;
+  }
+
+  bool header()
+  {
+    const char* magic = take(sizeof(snapshot_magic));
+    return magic && std::memcmp(magic, snapshot_magic, sizeof(snapshot_magic)) == 0
+      && u32() == snapshot_version;
+  }
+};
+
+// Read-only view of a whole file, memory mapped where the platform allows
+// and read into memory otherwise
+struct MappedFile
+{
+  const char* bytes = nullptr;
+  std::size_t length = 0;
+  bool mapped = false;
+  std::vector< char > buffer;
+
+  MappedFile() = default;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator= (const MappedFile&) = delete;
+
+  ~MappedFile()
+  {
+#if ENTT_MRUBY_MMAP
+    if(mapped)
+      ::munmap(const_cast< char* >(bytes), length);
+#endif
+  }
+
+  bool open(const std::string& path)
+  {
+#if ENTT_MRUBY_MMAP
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+      return false;
+    struct stat info;
+    if(::fstat(fd, &info) == 0 && info.st_size > 0)
+    {
+      void* address = ::mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(address != MAP_FAILED)
+      {
+        ::madvise(address, info.st_size, MADV_SEQUENTIAL);
+        bytes = static_cast< const char* >(address);
+        length = info.st_size;
+        mapped = true;
+      }
+    }
+    ::close(fd);
+    if(mapped)
+      return true;
+#endif
+    std::FILE* file = std::fopen(path.c_str(), "rb");
+    if(! file)
+      return false;
+    char chunk[ 1 << 16 ];
+    std::size_t count;
+    while((count = std::fread(chunk, 1, sizeof(chunk), file)) > 0)
+      buffer.insert(buffer.end(), chunk, chunk + count);
+    std::fclose(file);
+    bytes = buffer.data();
+    length = buffer.size();
+    return true;
+  }
+};
+
+// entt::snapshot archive. Each section is collected and written as a block
+// of entity ids followed by a block of component values.
+struct SnapshotOutputArchive
+{
+  using count_type = std::underlying_type_t< entt::entity >;
+
+  SnapshotWriter& out;
+  std::vector< entt::entity > entities;
+  std::vector< char > values;
+  std::uint32_t remaining = 0, value_size = 0;
+
+  void operator()(count_type count)
+  {
+    begin(count);
+  }
+
+  // An entity outside of a counted section is written as a section of one
+  void operator()(entt::entity entity)
+  {
+    if(! remaining)
+      begin(1);
+    entities.push_back(entity);
+    next();
+  }
+
+  template< typename Component >
+  void operator()(entt::entity entity, const Component& component)
+  {
+    static_assert(std::is_trivially_copyable_v< Component >,
+      "components in snapshots must be trivially copyable");
+    if(values.empty())
+      values.reserve(std::size_t(remaining) * sizeof(Component));
+    value_size = sizeof(Component);
+    entities.push_back(entity);
+    const auto at = values.size();
+    values.resize(at + sizeof(Component));
+    std::memcpy(values.data() + at, &component, sizeof(Component));
+    next();
+  }
+
+private:
+  void begin(count_type count)
+  {
+    remaining = count;
+    value_size = 0;
+    entities.clear();
+    entities.reserve(count);
+    values.clear();
+    if(! count)
+      finish();
+  }
+
+  void next()
+  {
+    if(! --remaining)
+      finish();
+  }
+
+  void finish()
+  {
+    out.u32(entities.size());
+    out.u32(value_size);
+    out.write(entities.data(), entities.size() * sizeof(entt::entity));
+    out.write(values.data(), values.size());
+  }
+};
+
+// entt::snapshot_loader archive, reads the sections of SnapshotOutputArchive
+// straight out of the snapshot's memory
+struct SnapshotInputArchive
+{
+  using count_type = std::underlying_type_t< entt::entity >;
+
+  SnapshotReader& in;
+  const char* entities = nullptr;
+  const char* values = nullptr;
+  std::uint32_t count = 0, value_size = 0, pos = 0;
+
+  void operator()(count_type& count)
+  {
+    begin();
+    count = this->count;
+  }
+
+  void operator()(entt::entity& entity)
+  {
+    if(pos == count)
+      begin();
+    entity = next_entity();
+  }
+
+  template< typename Component >
+  void operator()(entt::entity& entity, Component& component)
+  {
+    if(value_size != sizeof(Component))
+      in.failed = true;
+    const char* value = values ? values + std::size_t(pos) * value_size : nullptr;
+    entity = next_entity();
+    if(value && ! in.failed)
+      std::memcpy(&component, value, sizeof(Component));
+  }
+
+private:
+  void begin()
+  {
+    count = in.u32();
+    value_size = in.u32();
+    entities = in.take(std::size_t(count) * sizeof(entt::entity));
+    values = in.take(std::size_t(count) * value_size);
+    pos = 0;
+    if(in.failed)
+      count = 0;
+  }
+
+  entt::entity next_entity()
+  {
+    entt::entity entity = entt::null;
+    if(entities && pos < count)
+      std::memcpy(&entity, entities + std::size_t(pos++) * sizeof(entt::entity), sizeof(entt::entity));
+    else
+      in.failed = true;
+    return entity;
+  }
+};
+
+// Returns false for values that can't be stored: anything besides nil,
+// booleans, numbers, Strings, Symbols and Arrays or Hashes of those
+inline bool snapshot_encode(mrb_state* state, SnapshotWriter& out, mrb_value value, int depth = 0)
+{
+  if(depth > snapshot_max_depth)
+    return false;
+
+  switch(mrb_type(value))
+  {
+    case MRB_TT_FALSE:
+      out.u8(mrb_nil_p(value) ? snapshot_nil : snapshot_false);
+      return true;
+    case MRB_TT_TRUE:
+      out.u8(snapshot_true);
+      return true;
+    case MRB_TT_FIXNUM:
+    {
+      // Zigzag, small negative numbers stay short
+      const auto n = static_cast< std::int64_t >(mrb_fixnum(value));
+      out.u8(snapshot_fixnum);
+      out.varint((static_cast< std::uint64_t >(n) << 1) ^ static_cast< std::uint64_t >(n >> 63));
+      return true;
+    }
+    case MRB_TT_FLOAT:
+    {
+      const double x = mrb_float(value);
+      out.u8(snapshot_float);
+      out.write(&x, sizeof(x));
+      return true;
+    }
+    case MRB_TT_STRING:
+      out.u8(snapshot_string);
+      out.varint(RSTRING_LEN(value));
+      out.write(RSTRING_PTR(value), RSTRING_LEN(value));
+      return true;
+    case MRB_TT_SYMBOL:
+    {
+      mrb_int length;
+      const char* name = mrb_sym2name_len(state, mrb_symbol(value), &length);
+      out.u8(snapshot_symbol);
+      out.varint(length);
+      out.write(name, length);
+      return true;
+    }
+    case MRB_TT_ARRAY:
+    {
+      const mrb_int length = RARRAY_LEN(value);
+      out.u8(snapshot_array);
+      out.varint(length);
+      for(mrb_int i = 0; i < length; ++i)
+        if(! snapshot_encode(state, out, RARRAY_PTR(value)[i], depth + 1))
+          return false;
+      return true;
+    }
+    case MRB_TT_HASH:
+    {
+      const int arena = mrb_gc_arena_save(state);
+      mrb_value keys = mrb_hash_keys(state, value);
+      const mrb_int length = RARRAY_LEN(keys);
+      out.u8(snapshot_hash);
+      out.varint(length);
+      bool ok = true;
+      for(mrb_int i = 0; ok && i < length; ++i)
+      {
+        const mrb_value key = RARRAY_PTR(keys)[i];
+        ok = snapshot_encode(state, out, key, depth + 1)
+          && snapshot_encode(state, out, mrb_hash_get(state, value, key), depth + 1);
+      }
+      mrb_gc_arena_restore(state, arena);
+      return ok;
+    }
+    default:
+      return false;
+  }
+}
+
+// Returns nil and marks the reader failed on malformed input
+inline mrb_value snapshot_decode(mrb_state* state, SnapshotReader& in, int depth = 0)
+{
+  if(depth > snapshot_max_depth)
+  {
+    in.failed = true;
+    return mrb_nil_value();
+  }
+
+  const auto tag = in.u8();
+  switch(tag)
+  {
+    case snapshot_nil:
+      return mrb_nil_value();
+    case snapshot_false:
+      return mrb_false_value();
+    case snapshot_true:
+      return mrb_true_value();
+    case snapshot_fixnum:
+    {
+      const auto n = in.varint();
+      return mrb_fixnum_value(static_cast< mrb_int >((n >> 1) ^ (0 - (n & 1))));
+    }
+    case snapshot_float:
+    {
+      double x;
+      in.read(&x, sizeof(x));
+      return mrb_float_value(state, x);
+    }
+    case snapshot_string:
+    case snapshot_symbol:
+    {
+      const auto length = in.varint();
+      const char* bytes = in.take(length);
+      if(! bytes)
+        return mrb_nil_value();
+      return tag == snapshot_symbol
+        ? mrb_symbol_value(mrb_intern(state, bytes, length))
+        : mrb_str_new(state, bytes, length);
+    }
+    case snapshot_array:
+    {
+      const auto length = in.varint();
+      // Every element takes at least a byte, don't trust length further
+      if(length > in.size - in.pos)
+      {
+        in.failed = true;
+        return mrb_nil_value();
+      }
+      mrb_value array = mrb_ary_new_capa(state, length);
+      const int arena = mrb_gc_arena_save(state);
+      for(std::uint64_t i = 0; i < length && ! in.failed; ++i)
+      {
+        mrb_ary_push(state, array, snapshot_decode(state, in, depth + 1));
+        mrb_gc_arena_restore(state, arena);
+      }
+      return array;
+    }
+    case snapshot_hash:
+    {
+      const auto length = in.varint();
+      if(length > in.size - in.pos)
+      {
+        in.failed = true;
+        return mrb_nil_value();
+      }
+      mrb_value hash = mrb_hash_new_capa(state, length);
+      const int arena = mrb_gc_arena_save(state);
+      for(std::uint64_t i = 0; i < length && ! in.failed; ++i)
+      {
+        mrb_value key = snapshot_decode(state, in, depth + 1);
+        mrb_hash_set(state, hash, key, snapshot_decode(state, in, depth + 1));
+        mrb_gc_arena_restore(state, arena);
+      }
+      return hash;
+    }
+    default:
+      in.failed = true;
+      return mrb_nil_value();
+  }
+}
+
+// Skips one encoded value, marks the reader failed on malformed input
+inline void snapshot_skip(SnapshotReader& in, int depth = 0)
+{
+  if(depth > snapshot_max_depth)
+  {
+    in.failed = true;
+    return;
+  }
+
+  const auto tag = in.u8();
+  switch(tag)
+  {
+    case snapshot_nil:
+    case snapshot_false:
+    case snapshot_true:
+      return;
+    case snapshot_fixnum:
+      in.varint();
+      return;
+    case snapshot_float:
+      in.take(sizeof(double));
+      return;
+    case snapshot_string:
+    case snapshot_symbol:
+      in.take(in.varint());
+      return;
+    case snapshot_array:
+    case snapshot_hash:
+    {
+      const auto length = in.varint();
+      if(length > in.size - in.pos)
+      {
+        in.failed = true;
+        return;
+      }
+      const auto values = tag == snapshot_hash ? length * 2 : length;
+      for(std::uint64_t i = 0; i < values && ! in.failed; ++i)
+        snapshot_skip(in, depth + 1);
+      return;
+    }
+    default:
+      in.failed = true;
+  }
+}
+
+// Size of a static component's values in its section, empty components
+// only store entities
+template< typename Component >
+constexpr std::uint32_t snapshot_value_size()
+{
+  return std::is_empty_v< Component > ? 0 : sizeof(Component);
+}
+
+// Walks a snapshot's body, read after the header, without loading
+// anything so a load can fail before touching the registry. sections are
+// the value sizes of the entity section and of each static component.
+// Pools must be of a dynamic component named in the snapshot, for which
+// name_ok(name, length) holds, or have an id of at least first_dynamic.
+template< typename NameOk >
+bool snapshot_validate(SnapshotReader in, const std::vector< std::uint32_t >& sections, std::uint32_t first_dynamic, NameOk&& name_ok)
+{
+  for(const auto value_size : sections)
+  {
+    const auto count = in.u32();
+    const auto saved_size = in.u32();
+    // An empty section is written without a value size
+    if(count && saved_size != value_size)
+      return false;
+    in.take(std::size_t(count) * sizeof(entt::entity));
+    in.take(std::size_t(count) * saved_size);
+  }
+
+  std::vector< std::uint32_t > named;
+  const auto names = in.u32();
+  for(std::uint32_t i = 0; i < names && ! in.failed; ++i)
+  {
+    const auto saved = in.u32();
+    const auto length = in.u32();
+    const char* name = in.take(length);
+    if(! name || ! name_ok(name, length))
+      return false;
+    named.push_back(saved);
+  }
+
+  const auto pools = in.u32();
+  for(std::uint32_t i = 0; i < pools && ! in.failed; ++i)
+  {
+    const auto saved = in.u32();
+    const auto size = in.u32();
+    if(saved < first_dynamic && std::find(named.cbegin(), named.cend(), saved) == named.cend())
+      return false;
+    in.take(std::size_t(size) * sizeof(entt::entity));
+    for(std::uint32_t j = 0; j < size && ! in.failed; ++j)
+      snapshot_skip(in);
+  }
+  return ! in.failed;
+}
+
+} // ::MRuby
@@ -0,0 +1,176 @@
+#pragma once
+
+#include "scheduler.h"
+
+#include <mruby.h>
+#include <mruby/array.h>
+#include <mruby/compile.h>
+#include <mruby/error.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+namespace MRuby
+{
+
+// Extra mrb_states over the same registry, so a script system can work
+// through disjoint slices of a view on several cores at once. The VMs are
+// set up by RegistryMixin::mrb_init_vm_pool and only see static
+// components. Writes through Registry#set, #set_many and #remove are
+// limited to the components the running system declared, and so are
+// writes through component proxies.
+struct VMPool
+{
+  struct VM
+  {
+    mrb_state* state = nullptr;
+    mrb_value registry_object = mrb_nil_value();
+    // Rooted, one callable per loaded system
+    mrb_value procs = mrb_nil_value();
+    // The writable mask of this VM's Registry binding
+    std::vector< bool >* writable = nullptr;
+  };
+
+  struct Program
+  {
+    mrb_int slot;
+    std::vector< bool > writable;
+  };
+
+  std::vector< VM > vms;
+  std::unordered_map< std::string, Program > programs;
+  WorkerPool threads;
+  // Systems sharing the pool take turns, a VM is driven by one thread
+  std::mutex busy;
+
+  VMPool() = default;
+  VMPool(const VMPool&) = delete;
+  VMPool& operator= (const VMPool&) = delete;
+
+  ~VMPool()
+  {
+    threads.stop();
+    for(auto& vm : vms)
+      mrb_close(vm.state);
+  }
+
+  std::size_t size() const
+  {
+    return vms.size();
+  }
+
+  void add(mrb_state* state, mrb_value registry_object, std::vector< bool >& writable)
+  {
+    VM vm;
+    vm.state = state;
+    vm.registry_object = registry_object;
+    vm.procs = mrb_ary_new(state);
+    mrb_gc_register(state, vm.procs);
+    vm.writable = &writable;
+    vms.push_back(vm);
+  }
+
+  void start()
+  {
+    threads.start(vms.size());
+  }
+
+  // Evaluates code in every VM, it must return something responding to
+  // call(registry, ids, dt). writable is indexed by component id.
+  bool load(const std::string& name, const std::string& code, std::vector< bool > writable)
+  {
+    std::lock_guard< std::mutex > lock(busy);
+    const auto iter = programs.find(name);
+    const mrb_int slot = (iter != programs.cend())
+      ? iter->second.slot
+      : static_cast< mrb_int >(programs.size());
+
+    for(auto& vm : vms)
+    {
+      mrb_value proc = mrb_load_nstring(vm.state, code.data(), code.size());
+      if(vm.state->exc)
+      {
+        mrb_print_error(vm.state);
+        vm.state->exc = nullptr;
+        return false;
+      }
+      mrb_ary_set(vm.state, vm.procs, slot, proc);
+    }
+    programs[ name ] = { slot, std::move(writable) };
+    return true;
+  }
+
+  // Calls the named system in every VM, each with its own contiguous slice
+  // of entities. Returns false if a VM raised, its error is printed.
+  bool run(const std::string& name, const std::vector< entt::entity >& entities, double dt)
+  {
+    std::lock_guard< std::mutex > lock(busy);
+    const auto iter = programs.find(name);
+    if(iter == programs.cend() || vms.empty())
+      return false;
+    const auto& program = iter->second;
+
+    const std::size_t slices = std::min(vms.size(), entities.size());
+    std::mutex mutex;
+    std::condition_variable done_cv;
+    std::size_t remaining = slices;
+    std::atomic< bool > failed{ false };
+
+    for(std::size_t i = 0; i < slices; ++i)
+    {
+      const std::size_t begin = entities.size() * i / slices;
+      const std::size_t end = entities.size() * (i + 1) / slices;
+      threads.push([&, i, begin, end]
+      {
+        if(! run_slice(vms[i], program, entities.data() + begin, end - begin, dt))
+          failed = true;
+        std::lock_guard< std::mutex > lock(mutex);
+        if(! --remaining)
+          done_cv.notify_one();
+      });
+    }
+
+    std::unique_lock< std::mutex > wait(mutex);
+    done_cv.wait(wait, [&remaining] { return remaining == 0; });
+    return ! failed;
+  }
+
+private:
+  static mrb_value call_program(mrb_state* state, mrb_value args)
+  {
+    return mrb_funcall_argv(state, RARRAY_PTR(args)[0], mrb_intern_lit(state, "call"), 3, RARRAY_PTR(args) + 1);
+  }
+
+  static bool run_slice(VM& vm, const Program& program, const entt::entity* entities, std::size_t count, double dt)
+  {
+    mrb_state* state = vm.state;
+    *vm.writable = program.writable;
+
+    const int arena = mrb_gc_arena_save(state);
+    mrb_value ids = mrb_ary_new_capa(state, count);
+    for(std::size_t i = 0; i < count; ++i)
+      mrb_ary_push(state, ids, mrb_fixnum_value(std::underlying_type_t< entt::entity >(entities[i])));
+
+    mrb_value args[] = {
+      mrb_ary_entry(vm.procs, program.slot),
+      vm.registry_object,
+      ids,
+      mrb_float_value(state, dt)
+    };
+    mrb_bool raised = FALSE;
+    mrb_value result = mrb_protect(state, call_program, mrb_ary_new_from_values(state, 4, args), &raised);
+    if(raised)
+    {
+      state->exc = mrb_obj_ptr(result);
+      mrb_print_error(state);
+      state->exc = nullptr;
+    }
+    mrb_gc_arena_restore(state, arena);
+    vm.writable->clear();
+    return ! raised;
+  }
+};
+
+} // ::MRuby
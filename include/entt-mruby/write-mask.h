@@ -0,0 +1,82 @@
+#pragma once
+
+#include "mruby-bindings.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace MRuby
+{
+
+// The components scripts of one mrb_state may replace or remove, indexed
+// by component id. Enforced in the VMs of a VMPool, and in the main VM
+// while a Ruby system runs alongside other systems.
+struct WriteMask
+{
+  bool enforced = false;
+  std::vector< bool > writable;
+
+  bool allows(mrb_int type) const
+  {
+    return ! enforced
+      || (type >= 0 && static_cast< std::size_t >(type) < writable.size() && writable[ type ]);
+  }
+
+  // Enforce writes, a list of component ids, or stop enforcing on nullptr
+  void confine(const std::vector< mrb_int >* writes)
+  {
+    enforced = writes != nullptr;
+    writable.clear();
+    if(writes)
+      for(const auto type : *writes)
+        if(type >= 0)
+        {
+          if(static_cast< std::size_t >(type) >= writable.size())
+            writable.resize(type + 1, false);
+          writable[ type ] = true;
+        }
+  }
+};
+
+// Proxies and columns keep the mask of the state that created them, so a
+// write only tests a bit. The mask is found once per state and thread
+// through a hidden instance variable of Object, named without an @.
+struct WriteMaskCache
+{
+  mrb_state* state = nullptr;
+  std::uint64_t closed = 0;
+  const WriteMask* mask = nullptr;
+};
+
+inline WriteMaskCache& write_mask_cache()
+{
+  thread_local WriteMaskCache cache;
+  return cache;
+}
+
+inline void set_write_mask(mrb_state* state, const WriteMask* mask)
+{
+  mrb_iv_set(state, mrb_obj_value(state->object_class), mrb_intern_lit(state, "write_mask"), mrb_cptr_value(state, (void*)mask));
+  write_mask_cache() = { state, closed_states.load(std::memory_order_relaxed), mask };
+}
+
+// nullptr when nothing set a mask on state
+inline const WriteMask* write_mask(mrb_state* state)
+{
+  auto& cache = write_mask_cache();
+  const auto closed = closed_states.load(std::memory_order_relaxed);
+  if(cache.state != state || cache.closed != closed)
+  {
+    const mrb_value mask = mrb_iv_get(state, mrb_obj_value(state->object_class), mrb_intern_lit(state, "write_mask"));
+    cache = { state, closed, mrb_cptr_p(mask) ? (const WriteMask*)mrb_cptr(mask) : nullptr };
+  }
+  return cache.mask;
+}
+
+inline void check_write(mrb_state* state, const WriteMask* mask, mrb_int type)
+{
+  if(mask && ! mask->allows(type))
+    mrb_raise(state, mrb_exc_get(state, "RuntimeError"), "component is not writable by this system");
+}
+
+} // ::MRuby
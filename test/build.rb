@@ -7,6 +7,8 @@ opts = {
   cc: 'clang++',
   output: 'mruby-test',
   cfiles: 'mruby-test.cc',
+  cflags: '',
+  bench: false,
 }
 
 OptionParser.new do |o|
@@ -26,10 +28,18 @@ OptionParser.new do |o|
     opts[:cfiles] = cfiles
   end
 
+  o.on '--cflags=FLAGS', 'extra compiler flags, e.g. -O2' do |cflags|
+    opts[:cflags] = cflags
+  end
+
   o.on '-I=DIR', 'c++ header file dir' do |dir|
     (opts[:I] ||= []) << dir
   end
 
+  o.on '--bench', 'build the optimized benchmark, mruby-bench' do
+    opts[:bench] = true
+  end
+
 end.parse!
 
 fail = false
@@ -41,14 +51,20 @@ opts.each {|k,v|
 }
 abort if fail
 
+if opts[:bench]
+  opts[:cfiles] = 'mruby-bench.cc' if opts[:cfiles] == 'mruby-test.cc'
+  opts[:output] = 'mruby-bench' if opts[:output] == 'mruby-test'
+  opts[:cflags] = "-O2 -DNDEBUG #{opts[:cflags]}"
+end
+
 cmd = "#{opts[:cc]} \
-  -g -std=c++2a \
+  -g -std=c++2a #{opts[:cflags]} \
   -I #{opts[:entt]} \
   #{opts[:I].map{|dir| "-I#{dir}"}.join(' ') if opts[:I]} \
   -I ../include \
   #{opts[:cfiles]} \
   -o #{opts[:output]} \
-  -lmruby"
+  -lmruby -pthread"
 
 puts "Running command: #{cmd}"
 exit Kernel.system cmd
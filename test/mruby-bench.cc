@@ -0,0 +1,625 @@
+/*
+
+  $ ruby build.rb --entt=../entt/src --bench
+  $ ./mruby-bench [count]
+  $ ./mruby-bench --json bench.json [max count]
+
+*/
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+
+#include "entt-mruby/entt-mruby.h"
+
+#include <mruby/variable.h>
+
+
+struct Position
+{
+  double x, y;
+};
+
+MRUBY_COMPONENT_FIELDS(Position, x, y)
+
+struct Velocity
+{
+  double x, y;
+};
+
+MRUBY_COMPONENT_FIELDS(Velocity, x, y)
+
+struct Mass
+{
+  double value;
+};
+
+MRUBY_COMPONENT_FIELDS(Mass, value)
+
+struct Heat
+{
+  double value;
+};
+
+MRUBY_COMPONENT_FIELDS(Heat, value)
+
+
+struct BenchRegistry : entt::registry, MRuby::RegistryMixin< BenchRegistry >
+{
+  mrb_state* state;
+
+  static const int max_static_components;
+  int next_dynamic_component_id = max_static_components;
+
+  BenchRegistry(bool pooled = false)
+  {
+    state = pooled ? mrb_open_pooled() : mrb_open();
+    this->mrb_init< Position, Velocity, Mass, Heat >(state);
+  }
+
+  ~BenchRegistry()
+  {
+    mrb_close(state);
+  }
+};
+
+const int BenchRegistry::max_static_components = 32;
+
+
+template< typename Fn >
+double measure(Fn&& fn)
+{
+  const auto start = std::chrono::steady_clock::now();
+  fn();
+  const auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration< double >(end - start).count();
+}
+
+void report(const std::string& name, std::size_t count, double seconds)
+{
+  std::cout << name << ": " << count << " ops in " << seconds << "s, "
+    << (seconds * 1e9 / count) << " ns/op" << std::endl;
+}
+
+
+// Set, mark and remove one dynamic value on each of count entities
+void bench_dynamic_values(std::size_t count)
+{
+  BenchRegistry registry;
+  mrb_state* state = registry.state;
+
+  std::vector< entt::entity > entities(count);
+  for(auto& entity : entities)
+    entity = registry.create();
+
+  const auto type = registry.mrb_component_id("Health");
+  auto fn = registry.mrb_component_functions(type);
+
+  report("dynamic set", count, measure([&]
+  {
+    for(std::size_t i = 0; i < count; ++i)
+    {
+      const int arena = mrb_gc_arena_save(state);
+      mrb_value value = mrb_str_new_lit(state, "value");
+      fn->set(state, registry, entities[i], type, 1, &value);
+      mrb_gc_arena_restore(state, arena);
+    }
+  }));
+
+  report("full gc with dynamic values", 1, measure([&]
+  {
+    mrb_full_gc(state);
+  }));
+
+  report("dynamic remove", count, measure([&]
+  {
+    for(std::size_t i = 0; i < count; ++i)
+      fn->remove(state, registry, entities[i], type);
+  }));
+}
+
+// The previous scheme, one mrb_gc_register per value. Unregistering scans
+// the root array, so keep count small.
+void bench_gc_register(std::size_t count)
+{
+  mrb_state* state = mrb_open();
+  std::vector< mrb_value > values(count);
+
+  report("mrb_gc_register", count, measure([&]
+  {
+    for(std::size_t i = 0; i < count; ++i)
+    {
+      const int arena = mrb_gc_arena_save(state);
+      values[i] = mrb_str_new_lit(state, "value");
+      mrb_gc_register(state, values[i]);
+      mrb_gc_arena_restore(state, arena);
+    }
+  }));
+
+  report("mrb_gc_unregister", count, measure([&]
+  {
+    for(std::size_t i = 0; i < count; ++i)
+      mrb_gc_unregister(state, values[i]);
+  }));
+
+  mrb_close(state);
+}
+
+// Function set lookup through the flat table against the unordered_map it
+// replaced, then a full has? dispatch
+void bench_dispatch(std::size_t count)
+{
+  BenchRegistry registry;
+  mrb_state* state = registry.state;
+
+  const mrb_int types[] = {
+    entt::type_seq< Position >::value(),
+    registry.mrb_component_id("Health")
+  };
+  const auto entity = registry.create();
+  registry.emplace< Position >(entity);
+
+  std::unordered_map< mrb_int, MRuby::ComponentFunctionSet > map;
+  map[ entt::type_seq< Position >::value() ] = *registry.mrb_component_functions(types[0]);
+  map[ entt::type_seq< MRuby::DynamicComponents >::value() ] = *registry.mrb_component_functions(types[1]);
+
+  std::size_t found = 0;
+  report("dispatch unordered_map", count, measure([&]
+  {
+    for(std::size_t i = 0; i < count; ++i)
+    {
+      const mrb_int type = types[ i & 1 ];
+      const auto iter = map.find(
+        (type >= BenchRegistry::max_static_components)
+          ? entt::type_seq< MRuby::DynamicComponents >::value()
+          : type );
+      found += iter != map.cend();
+    }
+  }));
+
+  report("dispatch flat table", count, measure([&]
+  {
+    for(std::size_t i = 0; i < count; ++i)
+      found += registry.mrb_component_functions(types[ i & 1 ]) != nullptr;
+  }));
+
+  report("dispatch has?", count, measure([&]
+  {
+    for(std::size_t i = 0; i < count; ++i)
+    {
+      const mrb_int type = types[ i & 1 ];
+      auto fn = registry.mrb_component_functions(type);
+      found += mrb_test(fn->has(state, registry, entity, type));
+    }
+  }));
+
+  std::cout << "(" << found << " lookups)" << std::endl;
+}
+
+// A script reading and writing one component on every entity, per entity
+// against the bulk natives
+void bench_bulk_access(std::size_t count)
+{
+  BenchRegistry registry;
+  mrb_state* state = registry.state;
+
+  for(std::size_t i = 0; i < count; ++i)
+    registry.emplace< Position >(registry.create(), Position{ double(i), 0.0 });
+  registry.mrb_eval(state, "$ids = []; $registry.entities { |id| $ids << id }");
+
+  report("ruby get/set per entity", count, measure([&]
+  {
+    registry.mrb_eval(state, R"MRUBY(
+      $ids.each do |id|
+        p = $registry.get(id, :Position)
+        p[:y] = p[:x] * 0.5
+        $registry.set(id, :Position, p)
+      end
+    )MRUBY");
+  }));
+
+  report("ruby get_many/set_many", count, measure([&]
+  {
+    registry.mrb_eval(state, R"MRUBY(
+      columns = $registry.get_many(:Position, $ids)
+      columns[:y] = columns[:x].map { |x| x * 0.5 }
+      $registry.set_many(:Position, $ids, columns)
+    )MRUBY");
+  }));
+}
+
+// A whole-population update, one block call per entity against a column
+void bench_columns(std::size_t count)
+{
+  BenchRegistry registry;
+  mrb_state* state = registry.state;
+
+  for(std::size_t i = 0; i < count; ++i)
+    registry.emplace< Position >(registry.create(), Position{ double(i), 1.0 });
+
+  report("each_with x += 0.5 * y", count, measure([&]
+  {
+    registry.mrb_eval(state, R"MRUBY(
+      $registry.each_with(:Position) do |id, p|
+        $registry.set(id, :Position, x: p[:x] + 0.5 * p[:y])
+      end
+    )MRUBY");
+  }));
+
+  report("column axpy", count, measure([&]
+  {
+    registry.mrb_eval(state, R"MRUBY(
+      $registry.column(:Position, :x).axpy(0.5, $registry.column(:Position, :y))
+    )MRUBY");
+  }));
+}
+
+// A three component loop through the runtime view paths and through an
+// owning group, with a fourth component on half the entities so the
+// runtime view has to skip some
+void bench_groups(std::size_t count)
+{
+  BenchRegistry registry;
+  mrb_state* state = registry.state;
+
+  for(std::size_t i = 0; i < count; ++i)
+  {
+    const auto entity = registry.create();
+    registry.emplace< Position >(entity, Position{ double(i), 1.0 });
+    registry.emplace< Velocity >(entity, Velocity{ 0.5, 0.5 });
+    registry.emplace< Mass >(entity, Mass{ 1.0 });
+    if(i % 2)
+      registry.emplace< Heat >(entity, Heat{ 0.0 });
+  }
+  registry.mrb_define_group< Position, Velocity >(entt::get< Mass >);
+  registry.mrb_eval(state, "$group = $registry.group(owned: [:Position, :Velocity], observed: [:Mass])");
+
+  report("entities, runtime view", count, measure([&]
+  {
+    registry.mrb_eval(state, "$registry.entities(:Position, :Velocity, :Mass) { |id| }");
+  }));
+
+  report("each_with, runtime view", count, measure([&]
+  {
+    registry.mrb_eval(state, "$registry.each_with(:Position, :Velocity, :Mass) { |id, p, v, m| }");
+  }));
+
+  report("group each", count, measure([&]
+  {
+    registry.mrb_eval(state, "$group.each { |id, p, v, m| }");
+  }));
+}
+
+// A full sort of shuffled positions, then re-sorting storages that are
+// already in order, which is what a sort every frame mostly sees
+void bench_sorting(std::size_t count)
+{
+  BenchRegistry registry;
+  mrb_state* state = registry.state;
+
+  for(std::size_t i = 0; i < count; ++i)
+  {
+    const auto entity = registry.create();
+    registry.emplace< Position >(entity, Position{ double((i * 7919) % count), 1.0 });
+    registry.emplace< Velocity >(entity, Velocity{ 0.5, 0.5 });
+  }
+
+  report("sort by x, shuffled", count, measure([&]
+  {
+    registry.mrb_eval(state, "$registry.sort(:Position, by: :x)");
+  }));
+
+  report("sort by x, sorted", count, measure([&]
+  {
+    registry.mrb_eval(state, "$registry.sort(:Position, by: :x)");
+  }));
+
+  report("sort by x, sorted, incremental", count, measure([&]
+  {
+    registry.mrb_eval(state, "$registry.sort(:Position, by: :x, incremental: true)");
+  }));
+
+  report("sort_like, incremental", count, measure([&]
+  {
+    registry.mrb_eval(state, "$registry.sort_like(:Velocity, :Position, incremental: true)");
+  }));
+}
+
+// One script system over every entity, spread across 1 to 16 VMs
+void bench_vm_pool(std::size_t count)
+{
+  const char* code = R"MRUBY(
+    lambda do |registry, ids, dt|
+      ids.each do |id|
+        p = registry.get(id, :Position)
+        registry.set(id, :Position, x: p[:x] + p[:y] * dt)
+      end
+    end
+  )MRUBY";
+
+  for(std::size_t threads = 1; threads <= 16; threads *= 2)
+  {
+    BenchRegistry registry;
+    for(std::size_t i = 0; i < count; ++i)
+      registry.emplace< Position >(registry.create(), Position{ double(i), 1.0 });
+
+    registry.mrb_init_vm_pool< Position >(threads);
+    const auto position = BenchRegistry::mrb_components< Position >();
+    registry.mrb_add_parallel_system("integrate", code, position, {}, position);
+
+    report("vm pool, " + std::to_string(threads) + " threads", count, measure([&]
+    {
+      registry.mrb_run_systems(registry.state, 0.016);
+    }));
+  }
+}
+
+
+// Save and load a world of count entities with a Position each and a
+// dynamic Ruby value on every tenth
+void bench_snapshot(std::size_t count)
+{
+  const std::string path = "mruby-bench.snapshot";
+  std::size_t bytes = 0;
+  {
+    BenchRegistry registry;
+    mrb_state* state = registry.state;
+    const auto type = registry.mrb_component_id("Name");
+    auto fn = registry.mrb_component_functions(type);
+    for(std::size_t i = 0; i < count; ++i)
+    {
+      const auto entity = registry.create();
+      registry.emplace< Position >(entity, Position{ double(i), 1.0 });
+      if(i % 10 == 0)
+      {
+        const int arena = mrb_gc_arena_save(state);
+        mrb_value value = mrb_str_new_lit(state, "entity");
+        fn->set(state, registry, entity, type, 1, &value);
+        mrb_gc_arena_restore(state, arena);
+      }
+    }
+
+    const double seconds = measure([&]
+    {
+      bytes = registry.mrb_save_snapshot< Position >(state, path).bytes;
+    });
+    std::cout << "snapshot save: " << bytes << " bytes in " << seconds << "s, "
+      << (bytes / seconds / 1e6) << " MB/s" << std::endl;
+  }
+
+  BenchRegistry registry;
+  MRuby::SnapshotResult result;
+  const double seconds = measure([&]
+  {
+    result = registry.mrb_load_snapshot< Position >(registry.state, path);
+  });
+  if(! result)
+    std::cout << "snapshot load failed: " << result.error << std::endl;
+  else
+    std::cout << "snapshot load: " << result.bytes << " bytes in " << seconds << "s, "
+      << (result.bytes / seconds / 1e6) << " MB/s" << std::endl;
+  std::remove(path.c_str());
+}
+// Per-frame garbage, a Hash from every get, on the system allocator and on
+// the pool allocator
+void bench_allocator(std::size_t count)
+{
+  const std::size_t frames = 10;
+  for(const bool pooled : { false, true })
+  {
+    BenchRegistry registry(pooled);
+    mrb_state* state = registry.state;
+    for(std::size_t i = 0; i < count; ++i)
+      registry.emplace< Position >(registry.create(), Position{ double(i), 1.0 });
+
+    registry.mrb_eval(state, R"MRUBY(
+      def frame
+        $registry.entities(:Position) { |id| $registry.get(id, :Position) }
+      end
+    )MRUBY");
+
+    report(pooled ? "frame, pool allocator" : "frame, malloc", count * frames, measure([&]
+    {
+      for(std::size_t i = 0; i < frames; ++i)
+        registry.mrb_eval(state, "frame");
+    }));
+
+    if(pooled)
+    {
+      const auto& stats = registry.mrb_allocator_stats();
+      std::cout << "pool allocator: " << stats.allocations << " allocations, "
+        << stats.reused << " reused, " << stats.large << " large, "
+        << (stats.peak_bytes >> 10) << "KiB peak, "
+        << (stats.chunk_bytes >> 10) << "KiB in chunks" << std::endl;
+    }
+  }
+}
+// Frame times of an update loop producing a Hash per entity, with mruby
+// collecting whenever it allocates against collection paced to the end of
+// the frame
+void bench_gc_pacing(std::size_t count)
+{
+  const std::size_t frames = 300;
+  const char* modes[] = { "automatic gc", "paced gc", "paced generational gc" };
+  for(int mode = 0; mode < 3; ++mode)
+  {
+    BenchRegistry registry;
+    mrb_state* state = registry.state;
+    for(std::size_t i = 0; i < count; ++i)
+      registry.emplace< Position >(registry.create(), Position{ double(i), 1.0 });
+
+    registry.mrb_eval(state, R"MRUBY(
+      def frame
+        $registry.each_with(:Position) do |id, p|
+          $registry.set(id, :Position, x: p[:x] + 1.0, y: p[:y])
+        end
+      end
+    )MRUBY");
+    if(mode > 0)
+      registry.mrb_gc_pace(true);
+    if(mode > 1)
+      registry.mrb_gc_generational(true);
+
+    std::vector< double > times;
+    for(std::size_t i = 0; i < frames; ++i)
+      times.push_back(measure([&]
+      {
+        registry.mrb_eval(state, "frame");
+        if(mode > 0)
+          registry.mrb_gc_step(std::chrono::microseconds(1000));
+      }));
+
+    std::sort(times.begin(), times.end());
+    std::cout << modes[ mode ] << ": " << frames << " frames of " << count << " entities, p50 "
+      << (times[ frames / 2 ] * 1e3) << "ms, p99 "
+      << (times[ frames * 99 / 100 ] * 1e3) << "ms, max "
+      << (times.back() * 1e3) << "ms";
+    if(mode > 0)
+      std::cout << ", " << registry.mrb_gc_stats().forced << " forced";
+    std::cout << std::endl;
+  }
+}
+
+struct BenchResult
+{
+  std::string name;
+  std::size_t entities, ops;
+  double seconds;
+};
+
+// Ruby loop over every id in $ids, the cost of the loop itself is the same
+// for every binding
+std::string each_id(const std::string& body)
+{
+  return "ids = $ids; i = 0; n = ids.size\n"
+    "while i < n\n"
+    "  id = ids[i]\n"
+    "  " + body + "\n"
+    "  i += 1\n"
+    "end\n";
+}
+
+// Binding throughput at 1k up to max_count entities, written as JSON to
+// path so runs on different commits can be compared. Not to stdout, which
+// mrb_init and script errors print to.
+bool bench_bindings_json(std::size_t max_count, const char* path)
+{
+  std::vector< BenchResult > results;
+
+  for(std::size_t count = 1000; count <= max_count; count *= 10)
+  {
+    BenchRegistry registry;
+    mrb_state* state = registry.state;
+    const auto run = [&](const std::string& name, const std::string& script, std::size_t ops)
+    {
+      results.push_back({ name, count, ops, measure([&]
+      {
+        registry.mrb_eval(state, script);
+      }) });
+    };
+
+    mrb_gv_set(state, mrb_intern_lit(state, "$n"), mrb_fixnum_value(count));
+    run("create", R"MRUBY(
+      ids = Array.new($n); i = 0; n = $n
+      while i < n
+        ids[i] = $registry.create
+        i += 1
+      end
+      $ids = ids
+    )MRUBY", count);
+
+    registry.each([&registry](const entt::entity entity)
+    {
+      registry.emplace< Position >(entity, Position{ 1.0, 2.0 });
+      registry.emplace< Velocity >(entity, Velocity{ 0.5, 0.5 });
+      registry.emplace< Mass >(entity, Mass{ 1.0 });
+      registry.emplace< Heat >(entity, Heat{ 0.0 });
+    });
+
+    run("has/static", each_id("$registry.has?(id, :Position)"), count);
+    run("get/static", each_id("$registry.get(id, :Position)"), count);
+    run("set/static", each_id("$registry.set(id, :Position, x: 1.0, y: 2.0)"), count);
+
+    run("each_entity/1", "$registry.entities(:Position) { |id| }", count);
+    run("each_entity/2", "$registry.entities(:Position, :Velocity) { |id| }", count);
+    run("each_entity/3", "$registry.entities(:Position, :Velocity, :Mass) { |id| }", count);
+    run("each_entity/4", "$registry.entities(:Position, :Velocity, :Mass, :Heat) { |id| }", count);
+
+    run("each_entity/handle", "$registry.each_entity(:Position) { |e| }", count);
+    run("entity get/static", "$registry.each_entity(:Position) { |e| e.get(:Position) }", count);
+
+    run("query/4", "$registry.query(with: [:Position, :Velocity, :Mass, :Heat]).each { |id, p, v, m, h| }", count);
+    registry.mrb_eval(state, "$query = $registry.query(with: [:Position, :Velocity, :Mass, :Heat])");
+    run("query/4 precompiled", "$query.each { |id, p, v, m, h| }", count);
+
+    run("remove/static", each_id("$registry.remove(id, :Position)"), count);
+
+    run("set/dynamic", each_id("$registry.set(id, :Health, 10)"), count);
+    run("has/dynamic", each_id("$registry.has?(id, :Health)"), count);
+    run("get/dynamic", each_id("$registry.get(id, :Health)"), count);
+    run("remove/dynamic", each_id("$registry.remove(id, :Health)"), count);
+
+    // Every eval parses, keep the count down
+    const std::size_t evals = std::min< std::size_t >(count, 10000);
+    results.push_back({ "mrb_eval", count, evals, measure([&]
+    {
+      for(std::size_t i = 0; i < evals; ++i)
+        registry.mrb_eval(state, "1 + 1");
+    }) });
+  }
+
+  std::ofstream out(path);
+  out << "{\n  \"benchmarks\": [";
+  for(std::size_t i = 0; i < results.size(); ++i)
+  {
+    const auto& result = results[i];
+    out << (i ? ",\n" : "\n")
+      << "    {\"name\": \"" << result.name
+      << "\", \"entities\": " << result.entities
+      << ", \"ops\": " << result.ops
+      << ", \"seconds\": " << result.seconds
+      << ", \"ns_per_op\": " << (result.seconds * 1e9 / result.ops) << "}";
+  }
+  out << "\n  ]\n}" << std::endl;
+  return out.good();
+}
+
+
+int main(int argc, const char** argv)
+{
+  std::size_t count = 1000000;
+  const char* json = nullptr;
+  for(int i = 1; i < argc; ++i)
+    if(std::strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+      json = argv[ ++i ];
+    else
+      count = std::stoul(argv[i]);
+
+  if(json)
+  {
+    if(bench_bindings_json(count, json))
+      return 0;
+    std::cerr << "can't write " << json << std::endl;
+    return 1;
+  }
+
+  bench_dynamic_values(count);
+  bench_gc_register(count / 20);
+  bench_dispatch(count * 10);
+  bench_bulk_access(count);
+  bench_columns(count);
+  bench_groups(count);
+  bench_sorting(count);
+  bench_vm_pool(count);
+  bench_snapshot(count);
+  bench_allocator(count / 10);
+  bench_gc_pacing(count / 100);
+
+  return 0;
+}
@@ -18,6 +18,8 @@
 #include <mruby/numeric.h>
 
 #include <iostream>
+#include <fstream>
+#include <cstdio>
 
 
 
@@ -35,51 +37,22 @@ struct Transform
 
 
 
-template<>
-struct MRuby::ComponentInterface< Transform >
-: MRuby::DefaultComponentInterface< Transform >
-{
-  static mrb_value get(mrb_state* state, entt::registry& registry, entt::entity entity, entt::id_type type)
-  {
-    auto& transform = registry.get_or_emplace< Transform >(entity);
-
-    mrb_value hash = mrb_hash_new(state);
-
-    mrb_hash_set(state, hash,
-      mrb_symbol_value(mrb_intern_lit(state, "x")),
-      mrb_float_value(state, transform.x));
-    mrb_hash_set(state, hash,
-      mrb_symbol_value(mrb_intern_lit(state, "y")),
-      mrb_float_value(state, transform.y));
-    mrb_hash_set(state, hash,
-      mrb_symbol_value(mrb_intern_lit(state, "radians")),
-      mrb_float_value(state, transform.radians));
-
-    return hash;
-  }
-
-  static mrb_value set(mrb_state* state, entt::registry& registry, entt::entity entity, entt::id_type type, mrb_int argc, mrb_value* arg)
-  {
-    if(!argc || ! mrb_hash_p(arg[0]))
-      return mrb_nil_value();
-
-    Transform new_transform;
-    mrb_value x,y,radians;
+MRUBY_COMPONENT_PROXY_FIELDS(Transform, x, y, radians)
 
-    x = mrb_hash_get(state, arg[0], mrb_symbol_value(mrb_intern_lit(state, "x")));
-    y = mrb_hash_get(state, arg[0], mrb_symbol_value(mrb_intern_lit(state, "y")));
-    radians = mrb_hash_get(state, arg[0], mrb_symbol_value(mrb_intern_lit(state, "radians")));
-
-    new_transform.x = mrb_to_flo(state, x);
-    new_transform.y = mrb_to_flo(state, y);
-    new_transform.radians = mrb_to_flo(state, radians);
+struct Spin
+{
+  double rate;
+};
 
-    registry.emplace_or_replace< Transform >(entity, new_transform);
+MRUBY_COMPONENT_FIELDS(Spin, rate)
 
-    return arg[0];
-  }
+struct Tint
+{
+  double shade;
 };
 
+MRUBY_COMPONENT_FIELDS(Tint, shade)
+
 
 struct TestRegistry : entt::registry, MRuby::RegistryMixin< TestRegistry >
 {
@@ -91,8 +64,15 @@ struct TestRegistry : entt::registry, MRuby::RegistryMixin< TestRegistry >
 
   TestRegistry()
   {
-    state = mrb_open();
-    this->mrb_init< Transform >(state); //, func_map);
+    state = this->mrb_open_pooled();
+    this->mrb_init< Transform, Spin, Tint >(state); //, func_map);
+    this->mrb_enable_bytecode_cache(state);
+  }
+
+  // The state lives in the registry's pool, it must be closed first
+  ~TestRegistry()
+  {
+    mrb_close(state);
   }
 
   mrb_value eval(const std::string& code)
@@ -122,6 +102,7 @@ int main(int argc, const char** argv)
 
 
   TestRegistry registry;
+  registry.mrb_define_group< Spin, Tint >(entt::get< Transform >);
 
   auto e1 = registry.create();
   {
@@ -155,9 +136,8 @@ int main(int argc, const char** argv)
   test(R"MRUBY(
     10.times do
       #$registry.entities($registry.component_id('Transform'), $registry.component_id('Velocity')) do |e_id|
-      $registry.each_entity('Transform', 'Velocity') do |e_id|
-        e = $registry.entity e_id
-        puts "Entity: #{e.id}"
+      $registry.each_entity('Transform', 'Velocity') do |e|
+        puts "Entity: #{e.inspect}"
         transform = e.get('Transform')
         velocity = e.get('Velocity')
         transform[:x] += velocity[:x]
@@ -167,12 +147,169 @@ int main(int argc, const char** argv)
     end
   )MRUBY");
 
+  test(R"MRUBY(
+    $registry.each_with(:Transform, :Velocity) do |id, transform, velocity|
+      transform.x += velocity[:x]
+      transform.y += velocity[:y]
+    end
+    $entity.get('Transform')
+  )MRUBY");
+
+  test(R"MRUBY(
+    # each_entity reuses one handle, dup keeps an entity
+    kept = []
+    $registry.each_entity(:Transform) { |e| kept << e.dup }
+    [kept.include?($entity), $registry.entity($entity.id) == $entity, $entity.version]
+  )MRUBY");
+
+  test(R"MRUBY(
+    $frozen = $registry.create_entity
+    $frozen.set 'Transform', {x: 0.0, y: 0.0, radians: 0.0}
+    $frozen.set 'Frozen', true
+    moving = $registry.query(with: [:Transform], without: [:Frozen], optional: [:Velocity])
+    found = []
+    moving.each { |id, transform, velocity| found << [id, velocity.nil?] }
+    [found, moving.count]
+  )MRUBY");
+
+  // Asked for in another order than declared, and growing only once the
+  // iteration is over
+  test(R"MRUBY(
+    spinning = $registry.create
+    $registry.set spinning, :Transform, {x: 1.0, y: 2.0, radians: 0.0}
+    $registry.set spinning, :Spin, rate: 3.0
+    $registry.set spinning, :Tint, shade: 0.5
+    group = $registry.group(owned: [:Tint, :Spin], observed: [:Transform])
+    seen = []
+    group.each do |id, tint, spin, transform|
+      seen << [id == spinning, tint[:shade], spin[:rate], transform.y]
+      copy = $registry.create
+      $registry.set copy, :Transform, {x: 0.0, y: 0.0, radians: 0.0}
+      $registry.set copy, :Spin, rate: spin[:rate]
+      $registry.set copy, :Tint, shade: tint[:shade]
+    end
+    [seen, group.size]
+  )MRUBY");
+
+  test(R"MRUBY(
+    $registry.sort(:Transform, by: :x, descending: true)
+    xs = []
+    $registry.each_with(:Transform) { |id, transform| xs << transform.x }
+    $registry.sort_like(:Transform, :Velocity, incremental: true)
+    xs
+  )MRUBY");
+
+  test(R"MRUBY(
+    ids = [$entity.id, $registry.create]
+    columns = $registry.get_many(:Transform, ids)
+    columns[:x] = columns[:x].map { |x| (x || 0) + 1 }
+    columns[:y] = columns[:y].map { |y| y || 0 }
+    columns[:radians] = columns[:radians].map { |r| r || 0 }
+    $registry.set_many(:Transform, ids, columns)
+    $registry.get_many(:Transform, ids)
+  )MRUBY");
+
+  test(R"MRUBY(
+    xs = $registry.column(:Transform, :x)
+    ys = $registry.column(:Transform, :y)
+    xs.axpy(2.0, ys)
+    xs.clamp(-100, 100)
+    [xs.size, xs.min, xs.max, xs.dot(ys)]
+  )MRUBY");
+
   test(R"MRUBY(
     puts %Q{Velocity: #{ $entity.get('Velocity').inspect }}
     puts %Q{Transform: #{ $entity.get('Transform').inspect }}
     p $registry.all_components
   )MRUBY");
   
+  test(R"MRUBY(
+    $registry.on_construct(:Transform) { |ids| puts "constructed #{ids.size} Transforms" }
+    $registry.on_destroy(:Transform) { |ids| puts "destroyed #{ids.size} Transforms" }
+    $registry.on_update(:Velocity) { |ids| puts "updated Velocity of #{ids.inspect}" }
+    $entity.set 'Velocity', {x: 1.0, y: 1.0}
+    $registry.flush
+  )MRUBY");
+
+  test(R"MRUBY(
+    $registry.each_with(:Transform) do |id, transform|
+      child = $registry.create
+      $registry.set child, :Transform, {x: transform.x, y: transform.y, radians: 0.0}
+      $registry.destroy child
+    end
+    count = 0
+    $registry.entities(:Transform) { count += 1 }
+    count
+  )MRUBY");
+
+  registry.mrb_add_system("spin", {}, TestRegistry::mrb_components< Transform >(),
+    [](TestRegistry& registry, double dt)
+    {
+      registry.view< Transform >().each([dt](Transform& transform)
+      {
+        transform.radians += dt;
+      });
+    });
+
+  test(R"MRUBY(
+    $registry.system "move", reads: [:Velocity], writes: [:Transform] do |registry, dt|
+      registry.each_with(:Transform, :Velocity) do |id, transform, velocity|
+        transform.x += velocity[:x] * dt
+      end
+    end
+    $registry.run_systems 0.5
+    $registry.system_timings.keys
+  )MRUBY");
+
+  test(R"MRUBY(
+    $registry.track_changes :Velocity
+    since = $registry.tick
+    $registry.advance_tick
+    $entity.set 'Velocity', {x: 2.0, y: 0.0}
+    $registry.entities_changed_since(since, :Velocity)
+  )MRUBY");
+
+  test(R"MRUBY(
+    $entity.set 'Label', ['player', {hp: 10, tags: [:a, :b], speed: -1.5}]
+    bytes = $registry.save_snapshot 'mruby-test.snapshot'
+    $registry.load_snapshot 'mruby-test.snapshot'
+    [bytes, $entity.get('Label'), $entity.get('Transform')]
+  )MRUBY");
+
+  for(int i = 0; i < 3; ++i)
+    registry.eval("$entity.get('Transform')");
+  {
+    const auto& stats = registry.mrb_bytecode_cache_stats();
+    std::cout << "Bytecode cache: hits=" << stats.hits
+      << " misses=" << stats.misses << std::endl;
+  }
+
+#ifdef ENTT_MRUBY_PROFILE
+  test(R"MRUBY(
+    $registry.start_trace
+    $registry.entities(:Transform) { |id| $registry.get(id, :Transform) }
+    $registry.write_trace 'mruby-test-trace.json'
+    $registry.stats
+  )MRUBY");
+#endif
+
+  {
+    // Rewritten scripts run again in the same VM, same text is skipped
+    const std::string path = "mruby-test-reload.rb";
+    std::ofstream(path) << "$reloads = 0\n";
+    registry.mrb_watch_file(registry.state, path);
+    std::ofstream(path) << "$reloads += 1\n";
+    registry.mrb_reload_scripts(registry.state);
+    std::ofstream(path) << "$reloads += 1\n";
+    registry.mrb_reload_scripts(registry.state);
+    test("$reloads");
+    const auto& stats = registry.mrb_reload_stats();
+    std::cout << "Script reloads: " << stats.reloads
+      << " unchanged=" << stats.unchanged
+      << " last=" << (stats.last_seconds * 1e3) << "ms" << std::endl;
+    std::remove(path.c_str());
+  }
+
   if(! code.empty())
     registry.eval(code);
 